@@ -22,6 +22,14 @@
 #define CAPTURE_H
 #include "comdef.h"
 
+/**< capture sources */
+enum cap_src_t
+{
+	CAP_V4L = 0, /**< V4L2 device */
+	CAP_FILE, /**< raw YUYV/YUV420 file replayed in a loop, dev_name is the file path */
+	CAP_PATTERN /**< generated moving bars with a frame counter */
+};
+
 /**
  * capture parameters
  */
@@ -31,7 +39,24 @@ struct cap_param
 		int width; /**< video width */
 		int height; /**< video height */
 		U32 pixfmt; /**< video pixel format */
-		int rate; /**< video rate */
+		int rate; /**< video rate, <= 0 means as fast as possible for CAP_FILE/CAP_PATTERN */
+		int nbuffers; /**< number of capture buffers to request, <= 0 means default (4) */
+		int export_dmabuf; /**< export every buffer as a dmabuf fd (VIDIOC_EXPBUF), 0/1 */
+		enum cap_src_t source; /**< where the frames come from */
+};
+
+/**
+ * captured frame, owned by the caller between capture_acquire() and capture_release()
+ */
+struct cap_frame
+{
+		void *start; /**< frame data */
+		int length; /**< frame size */
+		int bytesperline; /**< bytes per line of the first plane, lines may be padded */
+		int index; /**< capture buffer index, used by capture_release() */
+		int dmabuf_fd; /**< dmabuf fd of the buffer, -1 if not exported. Owned by the capture, don't close it */
+		U64 timestamp; /**< capture time in microseconds, CLOCK_MONOTONIC */
+		U32 sequence; /**< driver frame sequence number, a gap means frames were dropped */
 };
 
 /**< capture handle */
@@ -72,6 +97,26 @@ void capture_stop(struct cap_handle *handle);
  */
 int capture_get_data(struct cap_handle *handle, void **pbuf, int *plen);
 
+/**
+ * @brief Dequeue a captured frame and take the ownership of its buffer
+ * Note: the buffer is not given back to the driver until capture_release()
+ * is called, so several frames can be held at the same time (at most
+ * nbuffers - 1 to keep the capture going). Don't mix with capture_get_data().
+ *
+ * @param handle the capture handle
+ * @param frame the captured frame
+ * @return -1 if timeout or error, 0 if ok, > 0 if non fatal error
+ */
+int capture_acquire(struct cap_handle *handle, struct cap_frame *frame);
+
+/**
+ * @brief Give a frame returned by capture_acquire() back to the driver
+ * @param handle the capture handle
+ * @param frame the frame to release
+ * @return 0 if ok, < 0 if error
+ */
+int capture_release(struct cap_handle *handle, struct cap_frame *frame);
+
 int capture_query_brightness(struct cap_handle *handle, int *min, int *max, int *step);
 int capture_get_brightness(struct cap_handle *handle, int *val);
 int capture_set_brightness(struct cap_handle *handle, int val);
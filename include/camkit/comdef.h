@@ -23,6 +23,7 @@
 #include <string.h>
 
 typedef unsigned int U32;
+typedef unsigned long long U64;
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
@@ -33,6 +33,17 @@ struct cvt_param
 		int outwidth; /**< output image width */
 		int outheight; /**< output image height */
 		U32 outpixfmt; /**< output image pixel format */
+		int nthreads; /**< convert threads, every one takes a horizontal band of the image, <= 1 means no threading. The ffmpeg converter uses 1 if the height is scaled */
+		int motion; /**< 1: measure the motion of every frame while converting it, see convert_get_motion() */
+};
+
+/**
+ * image planes, packed formats (eg: YUYV) use the first one only
+ */
+struct cvt_planes
+{
+		void *data[3]; /**< start of every plane, Y/U/V for YUV420 */
+		int stride[3]; /**< bytes per line of every plane, eg: v4l2 bytesperline */
 };
 
 /**< convert handle */
@@ -62,4 +73,44 @@ void convert_close(struct cvt_handle *handle);
 int convert_do(struct cvt_handle *handle, const void *inbuf, int isize,
 		void **poutbuf, int *posize);
 
+/**
+ * @brief Convert an image into the caller's planes
+ * Lines may be padded on both sides, eg: the input is a v4l2 buffer with
+ * its bytesperline, the output is the input picture of an encoder.
+ *
+ * @param handle the convert handle
+ * @param in the input image planes
+ * @param out the output image planes, of outwidth x outheight
+ * @return ok: 0, error: < 0
+ */
+int convert_do_into(struct cvt_handle *handle, const struct cvt_planes *in,
+		const struct cvt_planes *out);
+
+/**
+ * @brief Convert an image to several outputs (simulcast) in one pass
+ * Every handle gives the size of an output, they must have the same input.
+ * The backends that can do it convert a band of the input to all the
+ * outputs while it's in cache, the thread pool of the first handle is used.
+ *
+ * @param handles the convert handles, one for every output
+ * @param n the number of handles
+ * @param in the input image planes
+ * @param outs the output image planes, one for every handle
+ * @return ok: 0, error: < 0
+ */
+int convert_do_multi(struct cvt_handle **handles, int n,
+		const struct cvt_planes *in, const struct cvt_planes *outs);
+
+/**
+ * @brief Get the motion score of the last converted frame
+ * The converted luma is compared to the previous frame, on a subsampled
+ * grid, while it's still in cache. The score is the share of the sampled
+ * blocks that changed more than the sensor noise, the first frame is 1000.
+ * Note: it's measured before anything is drawn on the output (eg: timestamp)
+ *
+ * @param handle the convert handle
+ * @return the score 0-1000 (per mille), < 0 if not measured
+ */
+int convert_get_motion(struct cvt_handle *handle);
+
 #endif /* CONVERT_H */
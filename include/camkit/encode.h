@@ -28,6 +28,13 @@ enum pic_t
 	NONE = -1, SPS, PPS, I, P, B
 };
 
+/**< encoder threading */
+enum enc_thread_t
+{
+	ENC_SLICE_THREADS = 0, /**< threads share a frame, no delay (low latency) */
+	ENC_FRAME_THREADS /**< a frame per thread, more throughput, delays a frame per thread */
+};
+
 /**
  * encode parameters
  */
@@ -41,11 +48,46 @@ struct enc_param
 		int bitrate; /**< bit rate (kbps), set bit rate to 0 means no rate control, the rate will depend on QP */
 		int gop; /**< the size of group of pictures */
 		int chroma_interleave; /**< whether chroma interleaved? */
+		int max_b_frames; /**< max B frames between P frames, 0 means one frame in, one frame out (low latency) */
+		int intra_refresh; /**< 1: refresh the picture by a moving intra column over gop frames instead of I-frames, keeps the frame size flat */
+		enum enc_thread_t thread_type; /**< how the encoder threads split the work */
+		int threads; /**< encoder threads, <= 0 means auto (by the cores) */
+		int max_slice_size; /**< max bytes of a slice NALU, set to the pack max_pkt_len to send every NALU in one packet, <= 0 means one slice per frame */
+		int temporal_layers; /**< 2-3: temporal layers, the top layer is never referenced and can be dropped to halve the frame rate, the encoder may delay 2^(n-1)-1 frames, the ffmpeg encoder makes them of that many B frames in place of max_b_frames, <= 1 means none */
+};
+
+/**
+ * statistics of an encoded frame
+ */
+struct enc_stats
+{
+		U64 encode_usec; /**< wall time of the encode call that output the frame (microseconds), a delayed frame is partly encoded by earlier calls */
+		int bytes; /**< the encoded frame size */
+		int qp; /**< average quantization parameter, < 0 if the encoder doesn't report it */
+		enum pic_t type; /**< the frame type */
+		int keyframe; /**< 1: decoding can start at the frame (IDR) */
+		U64 timestamp; /**< the frame timestamp (microseconds) */
+};
+
+/**< max NAL units reported for a frame, see encode_get_nals() */
+#define ENC_MAX_NALS 256
+
+/**
+ * a NAL unit of an encoded frame, as the encoder wrote it
+ */
+struct enc_nal
+{
+		int offset; /**< the NALU header offset in the frame buffer, the start code is right before it */
+		int size; /**< the NALU size, without the start code */
+		int type; /**< nal_unit_type */
 };
 
 /**< encode handle */
 struct enc_handle;
 
+/**< gives an input buffer back to its owner, see encode_do_ref() */
+typedef void (*enc_release_fn)(void *opaque, void *buf);
+
 /**
  * @brief Open a encode instance
  * @param param the encode parameters
@@ -58,6 +100,18 @@ struct enc_handle *encode_open(struct enc_param param);
  */
 void encode_close(struct enc_handle *handle);
 
+/**
+ * @brief Get the encoder's own input picture (YUV420 planar, no padding)
+ * The caller can write a frame there directly (eg: by convert_do_into())
+ * and pass it back to encode_do(), which then skips copying it.
+ *
+ * @param handle the encode handle
+ * @param pbuf the point to point of the input picture
+ * @param plen the picture size
+ * @return 0 if ok, < 0 if the encoder has no such picture
+ */
+int encode_get_inbuf(struct enc_handle *handle, void **pbuf, int *plen);
+
 /**
  * @brief Fetch H264 headers: SPS, PPS
  * 1. Repeatedly call the function till it returns 0
@@ -86,9 +140,183 @@ int encode_get_headers(struct enc_handle *handle, void **pbuf, int *plen,
 int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 		int *polen, enum pic_t *type);
 
+/**
+ * @brief Encode a frame, carrying its capture timestamp
+ * The output frame may not be the input one if the encoder delays frames,
+ * its own timestamp is returned in pots.
+ *
+ * @param handle the encode handle
+ * @param ibuf the image buffer
+ * @param ilen the buffer len
+ * @param its the input frame timestamp (microseconds)
+ * @param pobuf pointer to the buffer to save the frame
+ * @param polen the buffer len pointer
+ * @param type the frame type pointer
+ * @param pots the output frame timestamp pointer (microseconds)
+ * @return -1 on error, 0 on ok
+ */
+int encode_do_ts(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		void **pobuf, int *polen, enum pic_t *type, U64 *pots);
+
+/**
+ * @brief Encode a frame without copying it, the encoder borrows ibuf
+ * release(opaque, ibuf) is called exactly once when the encoder is done
+ * with the buffer, which may be before the function returns or after a
+ * later call (eg: a delayed frame). Till then ibuf must not be reused.
+ * Backends that can't reference the buffer copy it and release it at once.
+ *
+ * @param handle the encode handle
+ * @param ibuf the image buffer (YUV420 planar, no padding)
+ * @param ilen the buffer len
+ * @param its the input frame timestamp (microseconds)
+ * @param release the function giving ibuf back to its owner
+ * @param opaque passed to release
+ * @param pobuf pointer to the buffer to save the frame
+ * @param polen the buffer len pointer
+ * @param type the frame type pointer
+ * @param pots the output frame timestamp pointer (microseconds)
+ * @return -1 on error, 0 on ok, ibuf is released in both cases
+ */
+int encode_do_ref(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		enc_release_fn release, void *opaque, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots);
+
+/**
+ * @brief Fetch the next ready packet
+ * An encoder may have several packets ready after encode_do() (which returns
+ * the first one) or encode_flush(), call the function till it returns 0.
+ * The buffer is valid till the next encode call.
+ *
+ * @param handle the encode handle
+ * @param pobuf pointer to the buffer to save the frame
+ * @param polen the buffer len pointer
+ * @param type the frame type pointer
+ * @param pots the output frame timestamp pointer (microseconds)
+ * @return 1 if got one, 0 if none, -1 if error
+ */
+int encode_get_packet(struct enc_handle *handle, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots);
+
+/**
+ * @brief Drain the frames delayed by the encoder (eg: B frames)
+ * Call encode_get_packet() afterwards to fetch them. Only for the end of the
+ * stream, no frame can be encoded after it.
+ *
+ * @param handle the encode handle
+ * @return 0 if ok, < 0 if error
+ */
+int encode_flush(struct enc_handle *handle);
+
+/**
+ * @brief Get the statistics of the last frame output by encode_do*() or encode_get_packet()
+ * @param handle the encode handle
+ * @param stats the statistics
+ * @return 0 if ok, < 0 if no frame has been output yet
+ */
+int encode_get_stats(struct enc_handle *handle, struct enc_stats *stats);
+
+/**
+ * @brief Get the NAL units of the last frame output by encode_do*() or encode_get_packet()
+ * The encoder knows them without scanning the frame, they are valid as long as the frame.
+ *
+ * @param handle the encode handle
+ * @param pnals pointer to the NAL units
+ * @param pnnals the number of NAL units pointer
+ * @return 0 if ok, < 0 if the encoder doesn't report them for the frame (the frame has to be scanned)
+ */
+int encode_get_nals(struct enc_handle *handle, const struct enc_nal **pnals,
+		int *pnnals);
+
+/**< asynchronous encode, a thread running encode_do_ref() on a bounded queue */
+struct enc_async;
+
+/**
+ * @brief Start an encoder thread on an opened encoder
+ * Note: the thread owns the encoder till encode_async_close(), don't call
+ * the other encode_* functions on the handle meanwhile, change its settings
+ * by the encode_async_set_*() functions.
+ *
+ * @param handle the encode handle
+ * @param depth the number of frames that can be submitted and not released yet
+ * @return the async handle, NULL if error
+ */
+struct enc_async *encode_async_open(struct enc_handle *handle, int depth);
+
+/**
+ * @brief Stop the encoder thread
+ * The frames not encoded yet are released, the outputs not polled are dropped.
+ * The encoder is drained so it gives back the frames it holds, their outputs
+ * are dropped too, and the encoder can only be closed afterwards.
+ * @param async the async handle
+ */
+void encode_async_close(struct enc_async *async);
+
+/**
+ * @brief Queue a frame to the encoder thread
+ * release(opaque, ibuf) is called from encode_submit(), encode_poll() or
+ * encode_async_close() in the caller thread once the frame is encoded.
+ *
+ * @param async the async handle
+ * @param ibuf the image buffer (YUV420 planar, no padding)
+ * @param ilen the buffer len
+ * @param its the input frame timestamp (microseconds)
+ * @param release the function giving ibuf back to its owner
+ * @param opaque passed to release
+ * @return 0 if queued, 1 if the queue is full (the caller keeps ibuf), < 0
+ * after encode_async_flush()
+ */
+int encode_submit(struct enc_async *async, void *ibuf, int ilen, U64 its,
+		enc_release_fn release, void *opaque);
+
+/**
+ * @brief Drain the encoder after the frames submitted so far
+ * The frames the encoder delays come out of encode_poll(), which waits for
+ * them with wait 1. No frame can be submitted afterwards.
+ * @param async the async handle
+ */
+void encode_async_flush(struct enc_async *async);
+
+/**
+ * @brief Fetch an output of the encoder thread, SPS/PPS or a frame
+ * The buffer is valid till the next call.
+ *
+ * @param async the async handle
+ * @param wait 1: wait while the thread has frames to encode or to flush, 0: return at once
+ * @param pobuf pointer to the buffer to save the output
+ * @param polen the buffer len pointer
+ * @param type the output type pointer
+ * @param pots the output timestamp pointer (microseconds)
+ * @return 1 if an output is returned, 0 if none
+ */
+int encode_poll(struct enc_async *async, int wait, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots);
+
+/**
+ * @brief Get the statistics of the last frame returned by encode_poll()
+ * @param async the async handle
+ * @param stats the statistics, encode_usec is the time the encoder thread took
+ * @return 0 if ok, < 0 if the last output was SPS/PPS or nothing
+ */
+int encode_async_get_stats(struct enc_async *async, struct enc_stats *stats);
+
+/**
+ * @brief Get the NAL units of the last frame returned by encode_poll(), see encode_get_nals()
+ * @param async the async handle
+ * @param pnals pointer to the NAL units
+ * @param pnnals the number of NAL units pointer
+ * @return 0 if ok, < 0 if the last output was SPS/PPS or the encoder doesn't report them
+ */
+int encode_async_get_nals(struct enc_async *async, const struct enc_nal **pnals,
+		int *pnnals);
+
 /**
  * @brief Set the quantization parameters
- * Note: the qp is used only when rate control is disable (bitrate is 0)
+ * Note: the qp is used only when rate control is disable (bitrate is 0).
+ * What it sets depends on the encoder:
+ * - vpu (FSL): the constant qp of every frame
+ * - ffmpeg (PC): the constant rate factor (crf) of x264, the frame qp varies
+ *   around it, as x264 takes a new crf at runtime but not a new constant qp
+ * - omx (RPI): not supported, returns < 0
  *
  * @param handle the encode handle
  * @param val the new qp value, it's 0-51 for h264
@@ -117,7 +345,7 @@ int encode_set_bitrate(struct enc_handle *handle, int val);
  * @brief Set frame rate
  * Note: the frame rate should be greater than 0
  * @param handle the encode handle
- * @param val the new bit rate (kbps)
+ * @param val the new frame rate (frames per second)
  * @return 0 if ok, < 0 if error
  */
 int encode_set_framerate(struct enc_handle *handle, int val);
@@ -130,4 +358,24 @@ int encode_set_framerate(struct enc_handle *handle, int val);
  */
 void encode_force_Ipic(struct enc_handle *handle);
 
+/**
+ * @brief Change the encoder settings while the encoder thread owns it
+ * The change is queued, the thread calls the encode_set_*() function of the
+ * same name before it encodes the next frame, and prints it if it fails.
+ * The last value set before that frame wins.
+ *
+ * @param async the async handle
+ * @param val the new value, see the encode_set_*() function
+ */
+void encode_async_set_qp(struct enc_async *async, int val);
+void encode_async_set_gop(struct enc_async *async, int val);
+void encode_async_set_bitrate(struct enc_async *async, int val);
+void encode_async_set_framerate(struct enc_async *async, int val);
+
+/**
+ * @brief Force the next frame the encoder thread encodes to be I-frame
+ * @param async the async handle
+ */
+void encode_async_force_Ipic(struct enc_async *async);
+
 #endif /* ENCODE_H */
@@ -20,7 +20,9 @@
 
 #ifndef INCLUDE_NETWORK_H_
 #define INCLUDE_NETWORK_H_
+#include <sys/uio.h>
 #include "comdef.h"
+#include "pack.h"
 
 enum net_t
 {
@@ -40,6 +42,19 @@ struct net_handle *net_open(struct net_param params);
 
 int net_send(struct net_handle *handle, void *data, int size);
 
+/**
+ * @brief Send a packet gathered from several buffers, eg: by pack_get_iov()
+ * @return the bytes sent, < 0 if error
+ */
+int net_sendv(struct net_handle *handle, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Send packets by one system call (sendmmsg), eg: from pack_get_batch()
+ * @return the number of packets sent, < 0 if none could be sent
+ */
+int net_send_batch(struct net_handle *handle, const struct pac_pkt *pkts,
+		int npkts);
+
 int net_recv(struct net_handle *handle, void *data, int size);
 
 void net_close(struct net_handle *handle);
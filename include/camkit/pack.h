@@ -20,12 +20,24 @@
 
 #ifndef INCLUDE_RTPPACK_H_
 #define INCLUDE_RTPPACK_H_
+#include <sys/uio.h>
 #include "comdef.h"
+#include "encode.h"
 
 struct pac_param
 {
         int max_pkt_len;    // maximum packet length, better be less than MTU(1500)
         int ssrc;			// identifies the synchronization source, set the value randomly, with the intent that no two synchronization sources within the same RTP session will have the same SSRC
+        int temporal_layers;	// the encoder's enc_param.temporal_layers, > 1 tags every packet with its layer by the RTP frame marking extension (8 bytes more), so a relay can drop the top layer
+        int aggregate;		// 1: consecutive small NALUs of a frame (eg: SPS, PPS, SEI, small slices) share a STAP-A packet up to max_pkt_len, they are copied, 0: a packet per NALU
+};
+
+/**< a packet of pack_get_batch() */
+struct pac_pkt
+{
+        struct iovec iov[2];	// the RTP and FU headers, the payload, as by pack_get_iov()
+        int iovcnt;
+        int len;		// the packet size
 };
 
 struct pac_handle;
@@ -40,6 +52,33 @@ struct pac_handle *pack_open(struct pac_param params);
  */
 void pack_put(struct pac_handle *handle, void *inbuf, int isize);
 
+/**
+ * @brief Put one or more NALUs of the same frame with its timestamp
+ * The RTP timestamp of the packets is derived from ts instead of the
+ * wall-clock time of packing.
+ *
+ * @param handle the pack handle
+ * @param inbuf the buffer pointed to one or more NALUs
+ * @param isize the inbuf size
+ * @param ts the frame timestamp (microseconds), eg: cap_frame.timestamp
+ */
+void pack_put_ts(struct pac_handle *handle, void *inbuf, int isize, U64 ts);
+
+/**
+ * @brief Put a frame with its timestamp and its NALUs from encode_get_nals()
+ * The NALUs are taken as they are, inbuf is not scanned for start codes.
+ * nals has to stay valid till the last packet of the frame is fetched.
+ *
+ * @param handle the pack handle
+ * @param inbuf the frame buffer
+ * @param isize the inbuf size
+ * @param ts the frame timestamp (microseconds)
+ * @param nals the NALUs of the frame, offsets into inbuf
+ * @param nnals the number of NALUs
+ */
+void pack_put_nals(struct pac_handle *handle, void *inbuf, int isize, U64 ts,
+		const struct enc_nal *nals, int nnals);
+
 /**
  * @brief Get a requested packet
  * @param handle the pack handle
@@ -49,6 +88,34 @@ void pack_put(struct pac_handle *handle, void *inbuf, int isize);
  */
 int pack_get(struct pac_handle *handle, void **poutbuf, int *outsize);
 
+/**
+ * @brief Get a requested packet without copying it
+ * The packet is iov[0], the RTP and FU headers, followed by iov[1], the
+ * payload in the buffer given to pack_put(), eg: for net_sendv().
+ * The headers are valid till the next call, the payload as long as the
+ * buffer of pack_put().
+ *
+ * @param handle the pack handle
+ * @param iov at least 2 entries to save the packet
+ * @param iovcnt the number of entries used
+ * @return 1 if got one, 0 if no more
+ */
+int pack_get_iov(struct pac_handle *handle, struct iovec *iov, int *iovcnt);
+
+/**
+ * @brief Get the next packets of the buffer given to pack_put(), a frame at once if max allows
+ * Like pack_get_iov(), nothing is copied but STAP-A payloads. The headers are
+ * kept in an arena of the handle, valid till the next pack_get*() call, eg: for
+ * net_send_batch(). Fewer than max packets doesn't mean the end, call the
+ * function till it returns 0.
+ *
+ * @param handle the pack handle
+ * @param pkts the packets
+ * @param max the number of entries of pkts
+ * @return the number of packets, 0 if no more
+ */
+int pack_get_batch(struct pac_handle *handle, struct pac_pkt *pkts, int max);
+
 void pack_close(struct pac_handle *handle);
 
 #endif /* INCLUDE_RTPPACK_H_ */
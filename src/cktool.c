@@ -35,11 +35,288 @@ FILE *outfd = NULL;
 int quit = 0;
 int debug = 0;
 
+// a capture buffer borrowed by the encoder
+struct borrowed_frame
+{
+	struct cap_handle *caphandle;
+	struct cap_frame frame;
+};
+
 static void quit_func(int sig)
 {
 	quit = 1;
 }
 
+#define MAX_LAYERS 4
+#define PKT_BATCH 64		// packets sent by one system call, a frame of up to 90 KB in 1400 bytes packets
+
+// a simulcast layer, converted with the main stream, encoded and packed on its own
+struct layer_t
+{
+	int width;
+	int height;
+	int bitrate;
+	struct cvt_handle *cvthandle;
+	struct enc_handle *enchandle;
+	struct pac_handle *pachandle;
+	void *buf;		// encoder input picture
+	int len;
+	void *own_buf;		// allocated if the encoder gives no input picture
+};
+
+#define MOTION_HOLD 1		// seconds of a still scene before idling
+
+// encodes every frame of a moving scene, one of idle_interval frames of a still one
+struct motion_policy
+{
+	int threshold;		// motion score (per mille) of a moving scene, 0: policy off
+	int idle_interval;
+	int hold;		// still frames encoded at the full rate
+	int still;		// still frames so far, up to hold + 1
+	int skipped;
+	int idle;		// 0/1, encoding at the idle rate
+};
+
+// encoder statistics of the main stream, printed every second in debug mode
+struct stats_sum
+{
+	int frames;
+	U64 usec;
+	U64 max_usec;
+	U64 bytes;
+	int qp_frames;		// frames reporting the qp
+	int qp;
+};
+
+// a converted frame queued to the encoder thread
+struct async_inbuf
+{
+	void *buf;
+	int busy;		// 0/1, owned by the encoder thread
+};
+
+static void release_frame(void *opaque, void *buf)
+{
+	struct borrowed_frame *bf = opaque;
+	UNUSED(buf);
+	capture_release(bf->caphandle, &bf->frame);
+}
+
+static void release_inbuf(void *opaque, void *buf)
+{
+	struct async_inbuf *ib = opaque;
+	UNUSED(buf);
+	ib->busy = 0;
+}
+
+static void free_inbufs(struct async_inbuf *inbufs, int n)
+{
+	int i;
+
+	if (!inbufs)
+		return;
+	for (i = 0; i < n; i++)
+		free(inbufs[i].buf);
+	free(inbufs);
+}
+
+// the planes of a YUV420 picture without padding
+static void yuv420_planes(void *buf, int width, int height,
+		struct cvt_planes *planes)
+{
+	planes->data[0] = buf;
+	planes->data[1] = (char *) buf + width * height;
+	planes->data[2] = (char *) planes->data[1] + width * height / 4;
+	planes->stride[0] = width;
+	planes->stride[1] = planes->stride[2] = width / 2;
+}
+
+// returns 1 if the frame should not be encoded, score is the convert_get_motion()
+static int motion_skip(struct motion_policy *mp, int score)
+{
+	if (mp->threshold <= 0 || score < 0)
+		return 0;
+
+	if (score >= mp->threshold)    // motion, back to the full rate at once
+	{
+		mp->still = 0;
+		mp->skipped = 0;
+		mp->idle = 0;
+		return 0;
+	}
+
+	if (mp->still <= mp->hold)
+	{
+		mp->still++;
+		return 0;
+	}
+
+	mp->idle = 1;
+	if (++mp->skipped < mp->idle_interval)
+		return 1;
+	mp->skipped = 0;
+	return 0;
+}
+
+static void add_stats(struct stats_sum *sum, const struct enc_stats *st)
+{
+	sum->frames++;
+	sum->usec += st->encode_usec;
+	if (st->encode_usec > sum->max_usec)
+		sum->max_usec = st->encode_usec;
+	sum->bytes += st->bytes;
+	if (st->qp >= 0)
+	{
+		sum->qp_frames++;
+		sum->qp += st->qp;
+	}
+}
+
+static void print_stats(struct stats_sum *sum, int fps)
+{
+	if (sum->frames == 0)
+		return;
+
+	U64 avg_usec = sum->usec / sum->frames;
+	printf("*** Encode: %d frames, %llu us avg, %llu us max, %llu bytes avg",
+			sum->frames, avg_usec, sum->max_usec, sum->bytes / sum->frames);
+	if (sum->qp_frames > 0)
+		printf(", qp %d", sum->qp / sum->qp_frames);
+	printf("\n");
+	if (fps > 0 && avg_usec > (U64) (1000000 / fps))
+		printf("!!! Encoder can't sustain %d fps\n", fps);
+
+	CLEAR(*sum);
+}
+
+// the NALUs the encoder reports for its last frame, 0 if it doesn't
+static int frame_nals(struct enc_handle *enchandle, const struct enc_nal **nals)
+{
+	int nnals;
+	return encode_get_nals(enchandle, nals, &nnals) == 0 ? nnals : 0;
+}
+
+static int polled_nals(struct enc_async *encasync, const struct enc_nal **nals)
+{
+	int nnals;
+	return encode_async_get_nals(encasync, nals, &nnals) == 0 ? nnals : 0;
+}
+
+// pack and send an encoded frame or header, nals are its NALUs if known (nnals > 0)
+static void put_encoded(int stage, struct pac_handle *pachandle,
+		struct net_handle *nethandle, void *enc_buf, int enc_len,
+		enum pic_t ptype, U64 enc_ts, const struct enc_nal *nals, int nnals)
+{
+	static struct pac_pkt pkts[PKT_BATCH];
+	int npkts, ret, i, j;
+
+	if (debug)
+	{
+		char c;
+		switch (ptype)
+		{
+			case PPS:
+				c = 'S';
+				break;
+			case SPS:
+				c = 'S';
+				break;
+			case I:
+				c = 'I';
+				break;
+			case P:
+				c = 'P';
+				break;
+			case B:
+				c = 'B';
+				break;
+			default:
+				c = 'N';
+				break;
+		}
+
+		fputc(c, stdout);
+	}
+
+	if ((stage & 0b00000100) == 0)		// no pack
+	{
+		if (outfd)
+			fwrite(enc_buf, 1, enc_len, outfd);
+
+		return;
+	}
+
+	// pack
+	if (nnals > 0)    // no start code scan
+		pack_put_nals(pachandle, enc_buf, enc_len, enc_ts, nals, nnals);
+	else
+		pack_put_ts(pachandle, enc_buf, enc_len, enc_ts);
+	// the packets point into enc_buf, no copy, a batch is sent at once
+	while ((npkts = pack_get_batch(pachandle, pkts, PKT_BATCH)) > 0)
+	{
+		if (debug)
+			for (i = 0; i < npkts; i++)
+				fputc('#', stdout);
+
+		if ((stage & 0b00001000) == 0)    // no network
+		{
+			for (i = 0; outfd && i < npkts; i++)
+				for (j = 0; j < pkts[i].iovcnt; j++)
+					fwrite(pkts[i].iov[j].iov_base, 1, pkts[i].iov[j].iov_len,
+							outfd);
+
+			continue;
+		}
+
+		// network
+		ret = net_send_batch(nethandle, pkts, npkts);
+		if (ret != npkts)
+		{
+			printf("!!! send pack failed, %d of %d packets sent, err: %s\n",
+					ret < 0 ? 0 : ret, npkts, strerror(errno));
+		}
+		if (debug)
+			for (i = 0; i < (ret < 0 ? 0 : ret); i++)
+				fputc('>', stdout);
+	}
+}
+
+static void encode_layer(int stage, struct layer_t *layer,
+		struct net_handle *nethandle, U64 ts)
+{
+	void *buf;
+	int len;
+	enum pic_t ptype;
+	U64 enc_ts;
+	const struct enc_nal *nals;
+	int nnals;
+
+	while (encode_get_headers(layer->enchandle, &buf, &len, &ptype) != 0)
+		put_encoded(stage, layer->pachandle, nethandle, buf, len, ptype, ts,
+				NULL, 0);
+
+	if (encode_do_ts(layer->enchandle, layer->buf, layer->len, ts, &buf, &len,
+			&ptype, &enc_ts) < 0)
+	{
+		printf("--- encode_do of layer %dx%d failed\n", layer->width,
+				layer->height);
+		return;
+	}
+	if (len <= 0)
+		return;
+
+	nnals = frame_nals(layer->enchandle, &nals);
+	put_encoded(stage, layer->pachandle, nethandle, buf, len, ptype, enc_ts,
+			nals, nnals);
+	while (encode_get_packet(layer->enchandle, &buf, &len, &ptype, &enc_ts)
+			== 1)
+	{
+		nnals = frame_nals(layer->enchandle, &nals);
+		put_encoded(stage, layer->pachandle, nethandle, buf, len, ptype,
+				enc_ts, nals, nnals);
+	}
+}
+
 static void display_usage(void)
 {
 	printf("Usage: #cktool [options]\n");
@@ -56,6 +333,7 @@ static void display_usage(void)
 	printf("-o dump to file (no dump)\n");
 	printf("-a ip address of stream server (none)\n");
 	printf("-p port of stream server (none)\n");
+	printf("-A aggregate small NALUs (SPS, PPS, SEI, small slices) into STAP-A packets\n");
 	printf("-c capture pixel format 0:YUYV, 1:YUV420 (YUYV)\n");
 	printf("-w width (640)\n");
 	printf("-h height (480)\n");
@@ -63,6 +341,24 @@ static void display_usage(void)
 	printf("-f fps (15)\n");
 	printf("-t chroma interleaved (0)\n");
 	printf("-g size of group of pictures (12)\n");
+	printf("-b max B frames, 0 for the lowest latency (0)\n");
+	printf("-R intra refresh over gop frames instead of I-frames (0)\n");
+	printf("-T number of encode threads, 0: by the cores (0)\n");
+	printf("-l simulcast layer WxH@kbps, converted with the main stream, packed with the next ssrc, up to %d\n",
+			MAX_LAYERS);
+	printf("-L temporal layers 2/3, the top layer can be dropped to halve the frame rate, tagged in RTP by frame marking,"
+			"\n\tmade of B frames: adds 1 (2 layers) or 3 (3 layers) frames of reorder delay, not with -b 0 (0)\n");
+	printf("-M motion score (per mille of the picture) of a moving scene, a still one is encoded at a lower rate, 0: off (0)\n");
+	printf("-I encode one of the given frames of a still scene (5)\n");
+	printf("-F encode threading 0:slice threads, low latency, 1:frame threads, more throughput (0)\n");
+	printf("-n number of capture buffers (4)\n");
+	printf("-x export capture buffers as dmabuf (0)\n");
+	printf("-m capture source 0:V4L2 device, 1:raw file given by -i, 2:test pattern (0)\n");
+	printf("-u unlimited capture rate for raw file and test pattern sources\n");
+	printf("-j number of convert threads (1)\n");
+	printf("-W width of the converted and encoded video (capture width)\n");
+	printf("-H height of the converted and encoded video (capture height)\n");
+	printf("-e encode in a thread, with a queue of the given depth (0: no thread)\n");
 }
 
 static void display_version(void)
@@ -82,6 +378,7 @@ int main(int argc, char *argv[])
 	struct pac_handle *pachandle = NULL;
 	struct net_handle *nethandle = NULL;
 	struct tms_handle *tmshandle = NULL;
+	struct enc_async *encasync = NULL;
 
 	struct cap_param capp;
 	struct cvt_param cvtp;
@@ -101,6 +398,9 @@ int main(int argc, char *argv[])
 	capp.height = 480;
 	capp.pixfmt = vfmt;
 	capp.rate = 15;
+	capp.nbuffers = 4;
+	capp.export_dmabuf = 0;
+	capp.source = CAP_V4L;
 
 	cvtp.inwidth = 640;
 	cvtp.inheight = 480;
@@ -108,6 +408,8 @@ int main(int argc, char *argv[])
 	cvtp.outwidth = 640;
 	cvtp.outheight = 480;
 	cvtp.outpixfmt = ofmt;
+	cvtp.nthreads = 1;
+	cvtp.motion = 0;
 
 	encp.src_picwidth = 640;
 	encp.src_picheight = 480;
@@ -117,9 +419,16 @@ int main(int argc, char *argv[])
 	encp.fps = 15;
 	encp.gop = 12;
 	encp.bitrate = 1000;
+	encp.max_b_frames = 0;
+	encp.intra_refresh = 0;
+	encp.thread_type = ENC_SLICE_THREADS;
+	encp.threads = 0;
+	encp.temporal_layers = 0;
 
 	pacp.max_pkt_len = 1400;
 	pacp.ssrc = 1234;
+	pacp.temporal_layers = 0;
+	pacp.aggregate = 0;
 
 	netp.serip = NULL;
 	netp.serport = -1;
@@ -131,9 +440,18 @@ int main(int argc, char *argv[])
 	tmsp.factor = 0;
 
 	char *outfile = NULL;
+	int unlimited = 0;
+	int owidth = 0, oheight = 0;
+	int async_depth = 0;
+	int bframes_set = 0;		// -b given, -L must not override it silently
+	struct motion_policy motion;
+	CLEAR(motion);
+	motion.idle_interval = 5;
+	struct layer_t layers[MAX_LAYERS];
+	int nlayers = 0;
 	// options
 	int opt = 0;
-	static const char *optString = "?vdi:o:a:p:w:h:r:f:t:g:s:c:";
+	static const char *optString = "?vduAi:o:a:p:w:h:r:f:t:g:s:c:n:x:m:j:W:H:e:b:R:T:F:l:L:M:I:";
 
 	opt = getopt(argc, argv, optString);
 	while (opt != -1)
@@ -192,6 +510,72 @@ int main(int argc, char *argv[])
 			case 'g':
 				encp.gop = atoi(optarg);
 				break;
+			case 'b':
+				encp.max_b_frames = atoi(optarg);
+				bframes_set = 1;
+				break;
+			case 'R':
+				encp.intra_refresh = atoi(optarg);
+				break;
+			case 'T':
+				encp.threads = atoi(optarg);
+				break;
+			case 'F':
+				encp.thread_type =
+						atoi(optarg) ? ENC_FRAME_THREADS : ENC_SLICE_THREADS;
+				break;
+			case 'l':
+				if (nlayers == MAX_LAYERS)
+				{
+					printf("!!! At most %d layers, %s ignored\n", MAX_LAYERS,
+							optarg);
+					break;
+				}
+				CLEAR(layers[nlayers]);
+				if (sscanf(optarg, "%dx%d@%d", &layers[nlayers].width,
+						&layers[nlayers].height, &layers[nlayers].bitrate) != 3)
+				{
+					printf("--- Bad layer: %s, should be WxH@kbps\n", optarg);
+					return -1;
+				}
+				nlayers++;
+				break;
+			case 'n':
+				capp.nbuffers = atoi(optarg);
+				break;
+			case 'x':
+				capp.export_dmabuf = atoi(optarg);
+				break;
+			case 'm':
+				capp.source = atoi(optarg);
+				break;
+			case 'u':
+				unlimited = 1;
+				break;
+			case 'A':
+				pacp.aggregate = 1;
+				break;
+			case 'j':
+				cvtp.nthreads = atoi(optarg);
+				break;
+			case 'W':
+				owidth = atoi(optarg);
+				break;
+			case 'H':
+				oheight = atoi(optarg);
+				break;
+			case 'e':
+				async_depth = atoi(optarg);
+				break;
+			case 'L':
+				encp.temporal_layers = pacp.temporal_layers = atoi(optarg);
+				break;
+			case 'M':
+				motion.threshold = atoi(optarg);
+				break;
+			case 'I':
+				motion.idle_interval = atoi(optarg);
+				break;
 			default:
 				printf("Unknown option: %s\n", optarg);
 				display_usage();
@@ -201,6 +585,31 @@ int main(int argc, char *argv[])
 		opt = getopt(argc, argv, optString);
 	}
 
+	if (encp.temporal_layers > 1 && bframes_set && encp.max_b_frames == 0)
+	{
+		printf("--- Temporal layers are made of B frames, -L can't be used with -b 0\n");
+		return -1;
+	}
+
+	// scale in the convert stage
+	if (owidth > 0)
+		cvtp.outwidth = encp.src_picwidth = encp.enc_picwidth =
+				tmsp.video_width = owidth;
+	if (oheight > 0)
+		cvtp.outheight = encp.src_picheight = encp.enc_picheight = oheight;
+
+	// a slice NALU per packet, a lost packet loses a slice, not the whole frame
+	encp.max_slice_size = (stage & 0b00000100) ? pacp.max_pkt_len : 0;
+
+	if (unlimited && capp.source != CAP_V4L)
+		capp.rate = 0;    // the encoder keeps its fps
+
+	// motion is measured by the converter
+	cvtp.motion = motion.threshold > 0;
+	motion.hold = encp.fps * MOTION_HOLD;
+	if (motion.idle_interval < 1)
+		motion.idle_interval = 1;
+
 	if (outfile)
 		outfd = fopen(outfile, "wb");
 
@@ -236,6 +645,51 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// encoder thread, the next frame is captured and converted while one is encoded
+	struct async_inbuf *inbufs = NULL;
+	int inbuf_size = encp.src_picwidth * encp.src_picheight * 3 / 2;
+	if ((stage & 0b00000010) != 0 && async_depth > 0)
+	{
+		if (capp.pixfmt == V4L2_PIX_FMT_YUV420)
+		{
+			// the queued frames are capture buffers, leave one to the driver
+			int nbuf = capp.nbuffers > 0 ? capp.nbuffers : 4;
+			if (async_depth > nbuf - 2)
+			{
+				async_depth = nbuf - 2;
+				printf("!!! Encode queue depth limited to %d by the capture buffers\n",
+						async_depth);
+			}
+		}
+		else
+		{
+			int i;
+			inbufs = calloc(async_depth, sizeof(struct async_inbuf));
+			for (i = 0; inbufs && i < async_depth; i++)
+			{
+				inbufs[i].buf = malloc(inbuf_size);
+				if (!inbufs[i].buf)
+					break;
+			}
+			if (!inbufs || i < async_depth)
+			{
+				printf("--- malloc encode input failed\n");
+				free_inbufs(inbufs, async_depth);
+				return -1;
+			}
+		}
+
+		if (async_depth > 0)
+		{
+			encasync = encode_async_open(enchandle, async_depth);
+			if (!encasync)
+			{
+				printf("--- Open encode thread failed\n");
+				return -1;
+			}
+		}
+	}
+
 	if ((stage & 0b00000100) != 0)
 	{
 		pachandle = pack_open(pacp);
@@ -246,6 +700,66 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// simulcast layers, they share the capture and the convert pass
+	if (nlayers > 0
+			&& ((stage & 0b00000100) == 0 || capp.pixfmt != V4L2_PIX_FMT_YUYV))
+	{
+		printf("!!! Simulcast layers need the pack stage and YUYV capture, ignored\n");
+		nlayers = 0;
+	}
+	int l;
+	for (l = 0; l < nlayers; l++)
+	{
+		struct cvt_param lcvtp = cvtp;
+		lcvtp.motion = 0;    // the same scene as the main stream
+		lcvtp.nthreads = 1;    // the layers run in the main pool (soft) or one by one (ffmpeg)
+		struct enc_param lencp = encp;
+		struct pac_param lpacp = pacp;
+
+		lcvtp.outwidth = layers[l].width;
+		lcvtp.outheight = layers[l].height;
+		layers[l].cvthandle = convert_open(lcvtp);
+
+		lencp.src_picwidth = lencp.enc_picwidth = layers[l].width;
+		lencp.src_picheight = lencp.enc_picheight = layers[l].height;
+		lencp.bitrate = layers[l].bitrate;
+		layers[l].enchandle = encode_open(lencp);
+
+		lpacp.ssrc = pacp.ssrc + 1 + l;
+		layers[l].pachandle = pack_open(lpacp);
+		if (!layers[l].cvthandle || !layers[l].enchandle
+				|| !layers[l].pachandle)
+		{
+			printf("--- Open simulcast layer %dx%d failed\n", layers[l].width,
+					layers[l].height);
+			return -1;
+		}
+
+		if (encode_get_inbuf(layers[l].enchandle, &layers[l].buf,
+				&layers[l].len) != 0)
+		{
+			layers[l].len = layers[l].width * layers[l].height * 3 / 2;
+			layers[l].buf = layers[l].own_buf = malloc(layers[l].len);
+			if (!layers[l].buf)
+			{
+				printf("--- malloc layer input failed\n");
+				return -1;
+			}
+		}
+		printf("+++ Simulcast layer %dx%d@%dkbps, ssrc: %d\n", layers[l].width,
+				layers[l].height, layers[l].bitrate, lpacp.ssrc);
+	}
+	struct cvt_handle *cvthandles[MAX_LAYERS + 1];
+	struct cvt_planes cvtouts[MAX_LAYERS + 1];
+	void *main_buf = NULL;		// main stream input if the encoder gives none
+	cvthandles[0] = cvthandle;
+	for (l = 0; l < nlayers; l++)
+	{
+		cvthandles[l + 1] = layers[l].cvthandle;
+		yuv420_planes(layers[l].buf, layers[l].width, layers[l].height,
+				&cvtouts[l + 1]);
+	}
+
 	if ((stage & 0b00001000) != 0)
 	{
 		if (netp.serip == NULL || netp.serport == -1)
@@ -268,9 +782,20 @@ int main(int argc, char *argv[])
 
 	// start capture encode loop
 	int ret;
-	void *cap_buf, *cvt_buf, *hd_buf, *enc_buf, *pac_buf;
-	int cap_len, cvt_len, hd_len, enc_len, pac_len;
+	void *cap_buf, *cvt_buf, *hd_buf, *enc_buf;
+	int cap_len, cvt_len, hd_len, enc_len;
+	struct async_inbuf *inbuf = NULL;
 	enum pic_t ptype;
+	struct cap_frame frame;
+	int frame_held = 0;
+	struct borrowed_frame borrowed[VIDEO_MAX_FRAME];
+	U32 next_sequence = 0;
+	struct stats_sum stats;
+	struct enc_stats st;
+	CLEAR(stats);
+	U64 enc_ts;
+	const struct enc_nal *nals;
+	int nnals;
 	struct timeval ctime, ltime;
 	unsigned long fps_counter = 0;
 	int sec, usec;
@@ -296,6 +821,7 @@ int main(int argc, char *argv[])
 			if (stat_time >= 1000000)    // >= 1s
 			{
 				printf("\n*** FPS: %ld\n", fps_counter);
+				print_stats(&stats, encp.fps);
 
 				fps_counter = 0;
 				ltime = ctime;
@@ -303,12 +829,19 @@ int main(int argc, char *argv[])
 			fps_counter++;
 		}
 
-		ret = capture_get_data(caphandle, &cap_buf, &cap_len);
+		// give the last frame back to the driver
+		if (frame_held)
+		{
+			capture_release(caphandle, &frame);
+			frame_held = 0;
+		}
+
+		ret = capture_acquire(caphandle, &frame);
 		if (ret != 0)
 		{
 			if (ret < 0)		// error
 			{
-				printf("--- capture_get_data failed\n");
+				printf("--- capture_acquire failed\n");
 				break;
 			}
 			else	// again
@@ -317,6 +850,13 @@ int main(int argc, char *argv[])
 				continue;
 			}
 		}
+		frame_held = 1;
+		cap_buf = frame.start;
+		cap_len = frame.length;
+		if (debug && next_sequence != 0 && frame.sequence != next_sequence)
+			printf("\n!!! %u frames dropped\n", frame.sequence - next_sequence);
+		next_sequence = frame.sequence + 1;
+
 		if (cap_len <= 0)
 		{
 			printf("!!! No capture data\n");
@@ -339,6 +879,53 @@ int main(int argc, char *argv[])
 			cvt_buf = cap_buf;
 			cvt_len = cap_len;
 		}
+		else if (encasync || nlayers > 0
+				|| ((stage & 0b00000010)
+						&& encode_get_inbuf(enchandle, &cvt_buf, &cvt_len) == 0))
+		{
+			// convert straight into the encoder's input picture, saves a frame copy
+			struct cvt_planes in;
+
+			if (encasync)		// a free input of the encoder thread
+			{
+				int i;
+				inbuf = NULL;
+				for (i = 0; i < async_depth && !inbuf; i++)
+					inbuf = inbufs[i].busy ? NULL : &inbufs[i];
+				if (!inbuf)
+				{
+					if (debug)
+						printf("\n!!! Encoder busy, frame dropped\n");
+					continue;
+				}
+				cvt_buf = inbuf->buf;
+				cvt_len = inbuf_size;
+			}
+			else if (nlayers > 0
+					&& encode_get_inbuf(enchandle, &cvt_buf, &cvt_len) != 0)
+			{
+				if (!main_buf && !(main_buf = malloc(inbuf_size)))
+				{
+					printf("--- malloc main stream input failed\n");
+					break;
+				}
+				cvt_buf = main_buf;
+				cvt_len = inbuf_size;
+			}
+
+			CLEAR(in);
+			in.data[0] = cap_buf;
+			in.stride[0] = frame.bytesperline;
+			yuv420_planes(cvt_buf, cvtp.outwidth, cvtp.outheight, &cvtouts[0]);
+
+			// the layers in the same pass
+			ret = convert_do_multi(cvthandles, nlayers + 1, &in, cvtouts);
+			if (ret < 0)
+			{
+				printf("--- convert_do_multi failed\n");
+				break;
+			}
+		}
 		else	// do convert: YUYV => YUV420
 		{
 			ret = convert_do(cvthandle, cap_buf, cap_len, &cvt_buf, &cvt_len);
@@ -367,51 +954,100 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
-		// encode
-		// fetch h264 headers first!
-		while ((ret = encode_get_headers(enchandle, &hd_buf, &hd_len, &ptype))
-				!= 0)
+		// a still scene is encoded at a lower frame rate
+		int idle = motion.idle;
+		int skip = motion_skip(&motion,
+				cvthandle ? convert_get_motion(cvthandle) : -1);
+		if (motion.idle != idle)
+		{
+			int rate = motion.idle ? encp.fps / motion.idle_interval : encp.fps;
+			if (rate < 1)
+				rate = 1;
+			if (debug)
+				printf("\n*** %s, %d fps\n",
+						motion.idle ? "Still scene" : "Motion", rate);
+			// the rate control spreads the bits over the frames really encoded
+			if (encasync)    // the thread owns the encoder
+				encode_async_set_framerate(encasync, rate);
+			else
+				encode_set_framerate(enchandle, rate);
+			for (l = 0; l < nlayers; l++)
+				encode_set_framerate(layers[l].enchandle, rate);
+		}
+		if (skip)
 		{
 			if (debug)
-				fputc('S', stdout);
+				fputc('_', stdout);
+			continue;
+		}
 
-			if ((stage & 0b00000100) == 0)		// no pack
-			{
-				if (outfd)
-					fwrite(hd_buf, 1, hd_len, outfd);
+		// encode
+		for (l = 0; l < nlayers; l++)
+			encode_layer(stage, &layers[l], nethandle, frame.timestamp);
 
-				continue;
-			}
+		if (encasync)
+		{
+			enc_release_fn release = release_inbuf;
+			void *opaque = inbuf;
 
-			// pack headers
-			pack_put(pachandle, hd_buf, hd_len);
-			while (pack_get(pachandle, &pac_buf, &pac_len) == 1)
+			if (cvt_buf == cap_buf)		// lend the capture buffer
 			{
-				if (debug)
-					fputc('#', stdout);
-
-				if ((stage & 0b00001000) == 0)    // no network
+				if (frame.index >= VIDEO_MAX_FRAME)
 				{
-					if (outfd)
-						fwrite(pac_buf, 1, pac_len, outfd);
-
+					printf("!!! Capture buffer %d out of range, frame dropped\n",
+							frame.index);
 					continue;
 				}
+				borrowed[frame.index].caphandle = caphandle;
+				borrowed[frame.index].frame = frame;
+				release = release_frame;
+				opaque = &borrowed[frame.index];
+			}
 
-				// network
-				ret = net_send(nethandle, pac_buf, pac_len);
-				if (ret != pac_len)
-				{
-					printf("send pack failed, size: %d, err: %s\n", pac_len,
-							strerror(errno));
-				}
-				if (debug)
-					fputc('>', stdout);
+			ret = encode_submit(encasync, cvt_buf, cvt_len, frame.timestamp,
+					release, opaque);
+			if (ret == 0)
+			{
+				if (cvt_buf == cap_buf)
+					frame_held = 0;
+				else
+					inbuf->busy = 1;
 			}
+			else if (debug)
+				printf("\n!!! Encoder busy, frame dropped\n");
+
+			while (encode_poll(encasync, 0, &enc_buf, &enc_len, &ptype,
+					&enc_ts) == 1)
+			{
+				if (debug && encode_async_get_stats(encasync, &st) == 0)
+					add_stats(&stats, &st);
+				nnals = polled_nals(encasync, &nals);
+				put_encoded(stage, pachandle, nethandle, enc_buf, enc_len,
+						ptype, enc_ts, nals, nnals);
+			}
+
+			continue;
 		}
 
-		ret = encode_do(enchandle, cvt_buf, cvt_len, &enc_buf, &enc_len,
-				&ptype);
+		// fetch h264 headers first!
+		while ((ret = encode_get_headers(enchandle, &hd_buf, &hd_len, &ptype))
+				!= 0)
+			put_encoded(stage, pachandle, nethandle, hd_buf, hd_len, ptype,
+					frame.timestamp, NULL, 0);
+
+		if (cvt_buf == cap_buf && frame.index < VIDEO_MAX_FRAME)
+		{
+			// no copy, the buffer goes back to the driver when the encoder is done with it
+			borrowed[frame.index].caphandle = caphandle;
+			borrowed[frame.index].frame = frame;
+			frame_held = 0;
+			ret = encode_do_ref(enchandle, cvt_buf, cvt_len, frame.timestamp,
+					release_frame, &borrowed[frame.index], &enc_buf, &enc_len,
+					&ptype, &enc_ts);
+		}
+		else
+			ret = encode_do_ts(enchandle, cvt_buf, cvt_len, frame.timestamp,
+					&enc_buf, &enc_len, &ptype, &enc_ts);
 		if (ret < 0)
 		{
 			printf("--- encode_do failed\n");
@@ -423,68 +1059,66 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
-		if (debug)
+		if (debug && encode_get_stats(enchandle, &st) == 0)
+			add_stats(&stats, &st);
+		nnals = frame_nals(enchandle, &nals);
+		put_encoded(stage, pachandle, nethandle, enc_buf, enc_len, ptype,
+				enc_ts, nals, nnals);
+		while (encode_get_packet(enchandle, &enc_buf, &enc_len, &ptype,
+				&enc_ts) == 1)
 		{
-			char c;
-			switch (ptype)
-			{
-				case PPS:
-					c = 'S';
-					break;
-				case SPS:
-					c = 'S';
-					break;
-				case I:
-					c = 'I';
-					break;
-				case P:
-					c = 'P';
-					break;
-				case B:
-					c = 'B';
-					break;
-				default:
-					c = 'N';
-					break;
-			}
-
-			fputc(c, stdout);
+			if (debug && encode_get_stats(enchandle, &st) == 0)
+				add_stats(&stats, &st);
+			nnals = frame_nals(enchandle, &nals);
+			put_encoded(stage, pachandle, nethandle, enc_buf, enc_len, ptype,
+					enc_ts, nals, nnals);
 		}
-
-		if ((stage & 0b00000100) == 0)		// no pack
+	}
+	if (encasync)
+	{
+		// send what the thread has encoded and the frames delayed by the encoder
+		encode_async_flush(encasync);
+		while (encode_poll(encasync, 1, &enc_buf, &enc_len, &ptype, &enc_ts)
+				== 1)
 		{
-			if (outfd)
-				fwrite(enc_buf, 1, enc_len, outfd);
-
-			continue;
+			nnals = polled_nals(encasync, &nals);
+			put_encoded(stage, pachandle, nethandle, enc_buf, enc_len, ptype,
+					enc_ts, nals, nnals);
 		}
-
-		// pack
-		pack_put(pachandle, enc_buf, enc_len);
-		while (pack_get(pachandle, &pac_buf, &pac_len) == 1)
+		encode_async_close(encasync);
+	}
+	else if ((stage & 0b00000010) != 0 && encode_flush(enchandle) == 0)
+	{
+		// the frames delayed by the encoder
+		while (encode_get_packet(enchandle, &enc_buf, &enc_len, &ptype,
+				&enc_ts) == 1)
 		{
-			if (debug)
-				fputc('#', stdout);
-
-			if ((stage & 0b00001000) == 0)    // no network
-			{
-				if (outfd)
-					fwrite(pac_buf, 1, pac_len, outfd);
-
-				continue;
-			}
-
-			// network
-			ret = net_send(nethandle, pac_buf, pac_len);
-			if (ret != pac_len)
+			nnals = frame_nals(enchandle, &nals);
+			put_encoded(stage, pachandle, nethandle, enc_buf, enc_len, ptype,
+					enc_ts, nals, nnals);
+		}
+	}
+	for (l = 0; l < nlayers; l++)
+	{
+		if (encode_flush(layers[l].enchandle) == 0)
+		{
+			while (encode_get_packet(layers[l].enchandle, &enc_buf, &enc_len,
+					&ptype, &enc_ts) == 1)
 			{
-				printf("!!! send pack failed, size: %d, err: %s\n", pac_len,
-						strerror(errno));
+				nnals = frame_nals(layers[l].enchandle, &nals);
+				put_encoded(stage, layers[l].pachandle, nethandle, enc_buf,
+						enc_len, ptype, enc_ts, nals, nnals);
 			}
-			if (debug)
-				fputc('>', stdout);
 		}
+		pack_close(layers[l].pachandle);
+		encode_close(layers[l].enchandle);
+		convert_close(layers[l].cvthandle);
+		free(layers[l].own_buf);
 	}
+	free(main_buf);
+	free_inbufs(inbufs, async_depth);
+	if (frame_held)
+		capture_release(caphandle, &frame);
 	capture_stop(caphandle);
 
 	if ((stage & 0b00001000) != 0)
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/*
+ * soft_convert and motion kernel test, runs every simd kernel the cpu
+ * supports and the c kernel on random lines of random widths, the outputs
+ * must be bit exact:
+ * #convert_test [rounds]
+ */
+
+#include <time.h>
+#include "motion.c"    // the kernels are static
+#include "soft_convert.c"
+
+#define DEFAULT_ROUNDS 2000
+#define MAX_WIDTH 1000		// output pixels of a line
+#define GUARD 0x5a		// the bytes a kernel must not write
+
+struct kernel_t
+{
+	const char *name;
+	convert_rows_fn convert_rows;
+	box2_rows_fn box2_rows;
+	box4_rows_fn box4_rows;
+	bilinear_rows_fn bilinear_rows;
+	bilinear_cols_fn bilinear_cols;
+	motion_row_fn motion_row;
+};
+
+static struct kernel_t kernels[4];
+static int nkernels;
+
+static void add_kernel(const char *name, convert_rows_fn convert_rows,
+		box2_rows_fn box2_rows, box4_rows_fn box4_rows,
+		bilinear_rows_fn bilinear_rows, bilinear_cols_fn bilinear_cols,
+		motion_row_fn motion_row)
+{
+	kernels[nkernels].name = name;
+	kernels[nkernels].convert_rows = convert_rows;
+	kernels[nkernels].box2_rows = box2_rows;
+	kernels[nkernels].box4_rows = box4_rows;
+	kernels[nkernels].bilinear_rows = bilinear_rows;
+	kernels[nkernels].bilinear_cols = bilinear_cols;
+	kernels[nkernels].motion_row = motion_row;
+	nkernels++;
+}
+
+// the c kernels first, they are the reference
+static void find_kernels(void)
+{
+	add_kernel("c", convert_rows_c, box2_rows_c, box4_rows_c, bilinear_rows_c,
+			bilinear_cols_c, motion_row_c);
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		add_kernel("sse2", convert_rows_sse2, box2_rows_sse2, box4_rows_sse2,
+				bilinear_rows_sse2, bilinear_cols_sse2, motion_row_sse2);
+	if (__builtin_cpu_supports("avx2"))    // only convert_rows has an avx2 version
+		add_kernel("avx2", convert_rows_avx2, box2_rows_sse2, box4_rows_sse2,
+				bilinear_rows_sse2, bilinear_cols_sse2, motion_row_sse2);
+#endif
+
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	add_kernel("neon", convert_rows_neon, box2_rows_neon, box4_rows_neon,
+			bilinear_rows_neon, bilinear_cols_neon, motion_row_neon);
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+		add_kernel("neon", convert_rows_neon, box2_rows_neon, box4_rows_neon,
+				bilinear_rows_neon, bilinear_cols_neon, motion_row_neon);
+#endif
+#endif
+}
+
+static void fill_random(uint8_t *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+// exact size buffers, so an over-read shows up under a memory checker
+static uint8_t *alloc_random(int len)
+{
+	uint8_t *buf = malloc(len);
+	if (!buf)
+	{
+		printf("--- malloc test buffer failed\n");
+		exit(-1);
+	}
+	fill_random(buf, len);
+
+	return buf;
+}
+
+static uint8_t *alloc_guard(int len)
+{
+	uint8_t *buf = malloc(len + 1);
+	if (!buf)
+	{
+		printf("--- malloc test buffer failed\n");
+		exit(-1);
+	}
+	memset(buf, GUARD, len + 1);
+
+	return buf;
+}
+
+// widths of whole simd steps, of odd tails and of the smallest images
+static int random_width(int round)
+{
+	if (round < 32)
+		return (round + 1) * 2;
+
+	return (rand() % (MAX_WIDTH / 2) + 1) * 2;
+}
+
+// y1, y2, u and v of a line pair, with a guard byte after each
+struct out_t
+{
+	uint8_t *y1, *y2, *u, *v;
+};
+
+static void alloc_out(struct out_t *out, int width)
+{
+	out->y1 = alloc_guard(width);
+	out->y2 = alloc_guard(width);
+	out->u = alloc_guard(width / 2);
+	out->v = alloc_guard(width / 2);
+}
+
+static void free_out(struct out_t *out)
+{
+	free(out->y1);
+	free(out->y2);
+	free(out->u);
+	free(out->v);
+}
+
+static int same_out(const struct out_t *a, const struct out_t *b, int width)
+{
+	return !memcmp(a->y1, b->y1, width + 1) && !memcmp(a->y2, b->y2, width + 1)
+			&& !memcmp(a->u, b->u, width / 2 + 1)
+			&& !memcmp(a->v, b->v, width / 2 + 1);
+}
+
+static int test_convert_rows(const struct kernel_t *k, int width)
+{
+	uint8_t *src1 = alloc_random(width * 2);
+	uint8_t *src2 = alloc_random(width * 2);
+	struct out_t ref, out;
+	int ok;
+
+	alloc_out(&ref, width);
+	alloc_out(&out, width);
+	convert_rows_c(src1, src2, ref.y1, ref.y2, ref.u, ref.v, width);
+	k->convert_rows(src1, src2, out.y1, out.y2, out.u, out.v, width);
+	ok = same_out(&ref, &out, width);
+
+	free_out(&ref);
+	free_out(&out);
+	free(src1);
+	free(src2);
+	return ok;
+}
+
+static int test_box2_rows(const struct kernel_t *k, int owidth)
+{
+	uint8_t *src[4];
+	struct out_t ref, out;
+	int i, ok;
+
+	for (i = 0; i < 4; i++)
+		src[i] = alloc_random(owidth * 4);
+	alloc_out(&ref, owidth);
+	alloc_out(&out, owidth);
+	box2_rows_c(src[0], src[1], src[2], src[3], ref.y1, ref.y2, ref.u, ref.v,
+			owidth);
+	k->box2_rows(src[0], src[1], src[2], src[3], out.y1, out.y2, out.u, out.v,
+			owidth);
+	ok = same_out(&ref, &out, owidth);
+
+	free_out(&ref);
+	free_out(&out);
+	for (i = 0; i < 4; i++)
+		free(src[i]);
+	return ok;
+}
+
+static int test_box4_rows(const struct kernel_t *k, int owidth)
+{
+	int stride = owidth * 8 + rand() % 64;    // line padding, the lines are read by the stride
+	uint8_t *src = alloc_random(stride * 7 + owidth * 8);
+	struct out_t ref, out;
+	int ok;
+
+	alloc_out(&ref, owidth);
+	alloc_out(&out, owidth);
+	box4_rows_c(src, stride, ref.y1, ref.y2, ref.u, ref.v, owidth);
+	k->box4_rows(src, stride, out.y1, out.y2, out.u, out.v, owidth);
+	ok = same_out(&ref, &out, owidth);
+
+	free_out(&ref);
+	free_out(&out);
+	free(src);
+	return ok;
+}
+
+static int test_bilinear_rows(const struct kernel_t *k, int width)
+{
+	int len = width * 2, frac = rand() % 257;
+	uint8_t *top = alloc_random(len);
+	uint8_t *bot = alloc_random(len);
+	uint16_t *ref = malloc((len + 1) * sizeof(uint16_t));
+	uint16_t *out = malloc((len + 1) * sizeof(uint16_t));
+	int ok;
+
+	ref[len] = out[len] = GUARD;
+	bilinear_rows_c(top, bot, frac, ref, len);
+	k->bilinear_rows(top, bot, frac, out, len);
+	ok = !memcmp(ref, out, (len + 1) * sizeof(uint16_t));
+
+	free(top);
+	free(bot);
+	free(ref);
+	free(out);
+	return ok;
+}
+
+// the luma or the chroma columns of a random scale to owidth
+static int test_bilinear_cols(const struct kernel_t *k, int owidth)
+{
+	int chroma = rand() % 2, step = chroma ? 4 : 2;
+	int iwidth = (rand() % (MAX_WIDTH / 2) + 2) * 2;
+	int n = chroma ? owidth / 2 : owidth;
+	struct tap_t *taps = malloc(n * sizeof(struct tap_t));
+	uint16_t *line = malloc(iwidth * 2 * sizeof(uint16_t));
+	uint8_t *ref = alloc_guard(n);
+	uint8_t *out = alloc_guard(n);
+	int i, ok;
+
+	if (!taps || !line)
+	{
+		printf("--- malloc test buffer failed\n");
+		exit(-1);
+	}
+	init_taps(taps, n, chroma ? iwidth / 2 : iwidth);
+	for (i = 0; i < iwidth * 2; i++)    // any blend of two 8 bits samples
+		line[i] = rand() % (255 * 256 + 1);
+	bilinear_cols_c(line + chroma, taps, step, ref, n);
+	k->bilinear_cols(line + chroma, taps, step, out, n);
+	ok = !memcmp(ref, out, n + 1);
+
+	free(taps);
+	free(line);
+	free(ref);
+	free(out);
+	return ok;
+}
+
+static int test_motion_row(const struct kernel_t *k, int width)
+{
+	uint8_t *cur = alloc_random(width);
+	uint8_t *ref1 = malloc(width);
+	uint8_t *ref2 = malloc(width);
+	int i, noise = rand() % (MOTION_NOISE * 2) + 1, ok;
+
+	// noise around the threshold, so some blocks count and some don't
+	for (i = 0; i < width; i++)
+		ref1[i] = ref2[i] = cur[i] + rand() % (2 * noise + 1) - noise;
+	ok = motion_row_c(cur, ref1, width) == k->motion_row(cur, ref2, width)
+			&& !memcmp(ref1, ref2, width);
+
+	free(cur);
+	free(ref1);
+	free(ref2);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+	int i, r, failed = 0;
+
+	srand(time(NULL));
+	find_kernels();
+	for (i = 1; i < nkernels; i++)
+	{
+		const struct kernel_t *k = &kernels[i];
+		int bad_convert = 0, bad_box2 = 0, bad_box4 = 0, bad_rows = 0,
+				bad_cols = 0, bad_motion = 0, bad;
+
+		for (r = 0; r < rounds; r++)
+		{
+			int width = random_width(r);
+			bad_convert += !test_convert_rows(k, width);
+			bad_box2 += !test_box2_rows(k, width);
+			bad_box4 += !test_box4_rows(k, width);
+			bad_rows += !test_bilinear_rows(k, width);
+			bad_cols += !test_bilinear_cols(k, width);
+			bad_motion += !test_motion_row(k, width);
+		}
+
+		bad = bad_convert + bad_box2 + bad_box4 + bad_rows + bad_cols + bad_motion;
+		printf("%s %s: mismatches in %d rounds\n", bad ? "---" : "+++", k->name,
+				rounds);
+		printf("    convert_rows %d, box2_rows %d, box4_rows %d\n", bad_convert,
+				bad_box2, bad_box4);
+		printf("    bilinear_rows %d, bilinear_cols %d, motion_row %d\n", bad_rows,
+				bad_cols, bad_motion);
+		failed += bad;
+	}
+	if (nkernels == 1)
+		printf("!!! No simd kernel on this cpu, nothing to compare\n");
+
+	return failed ? -1 : 0;
+}
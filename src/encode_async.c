@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "camkit/encode.h"
+
+#define OUTS_PER_INPUT 4	// output slots for every input, SPS/PPS come with the frames
+
+enum slot_state_t
+{
+	SLOT_FREE = 0, SLOT_QUEUED, SLOT_ENCODING, SLOT_RELEASED
+};
+
+enum flush_state_t
+{
+	FLUSH_NONE = 0, FLUSH_REQUESTED, FLUSH_DONE
+};
+
+enum reconf_flag_t
+{
+	RECONF_QP = 1, RECONF_GOP = 2, RECONF_BITRATE = 4, RECONF_FRAMERATE = 8,
+	RECONF_IPIC = 16
+};
+
+// encoder settings changed by the caller, the thread applies them before the next input
+struct reconf_t
+{
+	int flags;		// RECONF_*
+	int qp;
+	int gop;
+	int bitrate;
+	int framerate;
+};
+
+struct in_t
+{
+	void *buf;
+	int len;
+	U64 ts;
+	enc_release_fn release;
+	void *opaque;
+	struct enc_async *async;
+	enum slot_state_t state;
+};
+
+struct out_t
+{
+	void *buf;
+	int size;		// allocated size of buf
+	int len;
+	enum pic_t type;
+	U64 ts;
+	int has_stats;		// 0/1, stats is valid, not for SPS/PPS
+	struct enc_stats stats;
+	int nnals;		// 0 if the encoder doesn't report them
+	struct enc_nal *nals;		// ENC_MAX_NALS, allocated with the first ones
+};
+
+struct enc_async
+{
+	struct enc_handle *enc;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t in_cond;		// a new input or quit
+	pthread_cond_t out_cond;	// an output or a free output slot or a finished input
+	struct in_t *ins;
+	int depth;
+	int outstanding;		// inputs not given back to the caller yet
+	int *in_queue;		// queued input slots, in submit order
+	int in_head;
+	int in_count;
+	struct out_t *outs;
+	int nouts;
+	int out_head;
+	int out_count;
+	struct out_t polled;		// the output handed out by encode_poll()
+	int busy;		// the encoder thread works on an input
+	enum flush_state_t flush;		// the encoder is drained after the queued inputs
+	struct reconf_t reconf;
+	int quit;
+};
+
+// called by the encoder, mostly in the encoder thread, the caller's release runs in encode_poll()
+static void release_input(void *opaque, void *buf)
+{
+	struct in_t *in = opaque;
+	UNUSED(buf);
+
+	pthread_mutex_lock(&in->async->lock);
+	in->state = SLOT_RELEASED;
+	pthread_mutex_unlock(&in->async->lock);
+}
+
+// give the released inputs back to the caller
+static void run_releases(struct enc_async *async)
+{
+	int i;
+
+	for (i = 0; i < async->depth; i++)
+	{
+		struct in_t *in = &async->ins[i];
+
+		pthread_mutex_lock(&async->lock);
+		if (in->state != SLOT_RELEASED)
+		{
+			pthread_mutex_unlock(&async->lock);
+			continue;
+		}
+		in->state = SLOT_FREE;
+		async->outstanding--;
+		pthread_mutex_unlock(&async->lock);
+
+		in->release(in->opaque, in->buf);
+	}
+}
+
+// stats and nals are NULL for SPS/PPS
+static void push_output(struct enc_async *async, void *buf, int len,
+		enum pic_t type, U64 ts, const struct enc_stats *stats,
+		const struct enc_nal *nals, int nnals)
+{
+	struct out_t *out;
+
+	pthread_mutex_lock(&async->lock);
+	while (!async->quit && async->out_count == async->nouts)
+		pthread_cond_wait(&async->out_cond, &async->lock);
+	if (async->quit)
+	{
+		pthread_mutex_unlock(&async->lock);
+		return;
+	}
+	out = &async->outs[(async->out_head + async->out_count) % async->nouts];
+	pthread_mutex_unlock(&async->lock);
+
+	// the slot is not seen by encode_poll() till out_count grows
+	if (out->size < len)
+	{
+		void *nbuf = realloc(out->buf, len);
+		if (!nbuf)
+		{
+			printf("--- realloc encode output failed, %d bytes dropped\n", len);
+			return;
+		}
+		out->buf = nbuf;
+		out->size = len;
+	}
+	memcpy(out->buf, buf, len);
+	out->len = len;
+	out->type = type;
+	out->ts = ts;
+	out->has_stats = stats != NULL;
+	if (stats)
+		out->stats = *stats;
+	out->nnals = 0;
+	if (nals && !out->nals)
+		out->nals = malloc(ENC_MAX_NALS * sizeof(*nals));
+	if (nals && out->nals)
+	{
+		memcpy(out->nals, nals, nnals * sizeof(*nals));    // the offsets hold for the copy
+		out->nnals = nnals;
+	}
+
+	pthread_mutex_lock(&async->lock);
+	async->out_count++;
+	pthread_cond_broadcast(&async->out_cond);
+	pthread_mutex_unlock(&async->lock);
+}
+
+// a frame and the packets the encoder has ready after it
+static void push_frames(struct enc_async *async, void *buf, int len,
+		enum pic_t type, U64 ts)
+{
+	struct enc_stats stats;
+	const struct enc_nal *nals;
+	int nnals;
+
+	do
+	{
+		if (encode_get_nals(async->enc, &nals, &nnals) < 0)
+			nals = NULL;
+		push_output(async, buf, len, type, ts,
+				encode_get_stats(async->enc, &stats) == 0 ? &stats : NULL, nals,
+				nnals);
+	} while (encode_get_packet(async->enc, &buf, &len, &type, &ts) == 1);
+}
+
+// in the encoder thread, the setters only touch the encoder
+static void apply_reconf(struct enc_async *async, const struct reconf_t *reconf)
+{
+	if ((reconf->flags & RECONF_QP) && encode_set_qp(async->enc, reconf->qp) < 0)
+		printf("!!! Set qp %d failed\n", reconf->qp);
+	if ((reconf->flags & RECONF_GOP)
+			&& encode_set_gop(async->enc, reconf->gop) < 0)
+		printf("!!! Set gop %d failed\n", reconf->gop);
+	if ((reconf->flags & RECONF_BITRATE)
+			&& encode_set_bitrate(async->enc, reconf->bitrate) < 0)
+		printf("!!! Set bitrate %d kbps failed\n", reconf->bitrate);
+	if ((reconf->flags & RECONF_FRAMERATE)
+			&& encode_set_framerate(async->enc, reconf->framerate) < 0)
+		printf("!!! Set frame rate %d failed\n", reconf->framerate);
+	if (reconf->flags & RECONF_IPIC)
+		encode_force_Ipic(async->enc);
+}
+
+static void *encode_loop(void *arg)
+{
+	struct enc_async *async = arg;
+	struct in_t *in;
+	void *buf;
+	int len, ret, flushed;
+	enum pic_t type;
+	U64 ts;
+	struct reconf_t reconf;
+
+	pthread_mutex_lock(&async->lock);
+	while (1)
+	{
+		while (!async->quit && async->in_count == 0
+				&& async->flush != FLUSH_REQUESTED)
+			pthread_cond_wait(&async->in_cond, &async->lock);
+		if (async->quit)
+			break;
+
+		if (async->in_count == 0)		// all encoded, the delayed frames out
+		{
+			pthread_mutex_unlock(&async->lock);
+			if (encode_flush(async->enc) == 0
+					&& encode_get_packet(async->enc, &buf, &len, &type, &ts) == 1)
+				push_frames(async, buf, len, type, ts);
+
+			pthread_mutex_lock(&async->lock);
+			async->flush = FLUSH_DONE;
+			pthread_cond_broadcast(&async->out_cond);
+			continue;
+		}
+
+		in = &async->ins[async->in_queue[async->in_head]];
+		async->in_head = (async->in_head + 1) % async->depth;
+		async->in_count--;
+		in->state = SLOT_ENCODING;
+		async->busy = 1;
+		reconf = async->reconf;
+		async->reconf.flags = 0;
+		pthread_mutex_unlock(&async->lock);
+
+		if (reconf.flags)
+			apply_reconf(async, &reconf);
+
+		// fetch h264 headers first!
+		while (encode_get_headers(async->enc, &buf, &len, &type) != 0)
+			push_output(async, buf, len, type, in->ts, NULL, NULL, 0);
+
+		ret = encode_do_ref(async->enc, in->buf, in->len, in->ts,
+				release_input, in, &buf, &len, &type, &ts);
+		if (ret < 0)
+			printf("--- encode_do_ref failed\n");
+		else if (len > 0)
+			push_frames(async, buf, len, type, ts);
+
+		pthread_mutex_lock(&async->lock);
+		async->busy = 0;
+		pthread_cond_broadcast(&async->out_cond);
+	}
+	flushed = async->flush == FLUSH_DONE;
+	pthread_mutex_unlock(&async->lock);
+	if (flushed)
+		return NULL;
+
+	// drain the encoder, so it drops the inputs it still holds, nobody polls the outputs
+	if (encode_flush(async->enc) == 0)
+	{
+		while (encode_get_packet(async->enc, &buf, &len, &type, &ts) == 1)
+			;
+	}
+
+	return NULL;
+}
+
+struct enc_async *encode_async_open(struct enc_handle *handle, int depth)
+{
+	struct enc_async *async = malloc(sizeof(struct enc_async));
+	if (!async)
+	{
+		printf("--- malloc encode async failed\n");
+		return NULL;
+	}
+
+	CLEAR(*async);
+	async->enc = handle;
+	async->depth = depth > 1 ? depth : 1;
+	async->nouts = async->depth * OUTS_PER_INPUT;
+	async->flush = FLUSH_NONE;
+	async->quit = 0;
+
+	async->ins = calloc(async->depth, sizeof(struct in_t));
+	async->in_queue = calloc(async->depth, sizeof(int));
+	async->outs = calloc(async->nouts, sizeof(struct out_t));
+	if (!async->ins || !async->in_queue || !async->outs)
+	{
+		printf("--- calloc encode queues failed\n");
+		goto err;
+	}
+
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->in_cond, NULL);
+	pthread_cond_init(&async->out_cond, NULL);
+	if (pthread_create(&async->thread, NULL, encode_loop, async) != 0)
+	{
+		printf("--- create encode thread failed\n");
+		pthread_cond_destroy(&async->out_cond);
+		pthread_cond_destroy(&async->in_cond);
+		pthread_mutex_destroy(&async->lock);
+		goto err;
+	}
+
+	printf("+++ Encode thread started, queue depth: %d\n", async->depth);
+	return async;
+
+	err: free(async->outs);
+	free(async->in_queue);
+	free(async->ins);
+	free(async);
+	return NULL;
+}
+
+void encode_async_close(struct enc_async *async)
+{
+	int i, held = 0;
+
+	pthread_mutex_lock(&async->lock);
+	async->quit = 1;
+	pthread_cond_broadcast(&async->in_cond);
+	pthread_cond_broadcast(&async->out_cond);
+	pthread_mutex_unlock(&async->lock);
+	pthread_join(async->thread, NULL);
+
+	run_releases(async);
+	for (i = 0; i < async->depth; i++)
+	{
+		struct in_t *in = &async->ins[i];
+
+		if (in->state == SLOT_QUEUED)	// never encoded
+			in->release(in->opaque, in->buf);
+		else if (in->state == SLOT_ENCODING)
+			held++;
+	}
+
+	for (i = 0; i < async->nouts; i++)
+	{
+		free(async->outs[i].buf);
+		free(async->outs[i].nals);
+	}
+	free(async->polled.buf);
+	free(async->polled.nals);
+	if (held)
+	{
+		// it would release them into freed memory, the queue is left to it
+		printf("!!! Encoder still holds %d input buffers after the drain\n", held);
+		return;
+	}
+	pthread_cond_destroy(&async->out_cond);
+	pthread_cond_destroy(&async->in_cond);
+	pthread_mutex_destroy(&async->lock);
+	free(async->outs);
+	free(async->in_queue);
+	free(async->ins);
+	free(async);
+	printf("+++ Encode thread stopped\n");
+}
+
+int encode_submit(struct enc_async *async, void *ibuf, int ilen, U64 its,
+		enc_release_fn release, void *opaque)
+{
+	struct in_t *in = NULL;
+	int i;
+
+	run_releases(async);
+
+	pthread_mutex_lock(&async->lock);
+	if (async->flush != FLUSH_NONE)
+	{
+		pthread_mutex_unlock(&async->lock);
+		printf("--- Encoder flushed, no more frames\n");
+		return -1;
+	}
+	if (async->outstanding == async->depth)
+	{
+		pthread_mutex_unlock(&async->lock);
+		return 1;
+	}
+	for (i = 0; i < async->depth; i++)
+	{
+		if (async->ins[i].state == SLOT_FREE)
+		{
+			in = &async->ins[i];
+			break;
+		}
+	}
+
+	in->buf = ibuf;
+	in->len = ilen;
+	in->ts = its;
+	in->release = release;
+	in->opaque = opaque;
+	in->async = async;
+	in->state = SLOT_QUEUED;
+	async->in_queue[(async->in_head + async->in_count) % async->depth] = i;
+	async->in_count++;
+	async->outstanding++;
+	pthread_cond_signal(&async->in_cond);
+	pthread_mutex_unlock(&async->lock);
+
+	return 0;
+}
+
+void encode_async_flush(struct enc_async *async)
+{
+	pthread_mutex_lock(&async->lock);
+	if (async->flush == FLUSH_NONE)
+	{
+		async->flush = FLUSH_REQUESTED;
+		pthread_cond_signal(&async->in_cond);
+	}
+	pthread_mutex_unlock(&async->lock);
+}
+
+int encode_poll(struct enc_async *async, int wait, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	struct out_t out;
+
+	pthread_mutex_lock(&async->lock);
+	if (wait)
+	{
+		// nothing will come once the queued inputs are all encoded and flushed
+		while (async->out_count == 0
+				&& (async->in_count > 0 || async->busy
+						|| async->flush == FLUSH_REQUESTED))
+			pthread_cond_wait(&async->out_cond, &async->lock);
+	}
+	pthread_mutex_unlock(&async->lock);
+
+	run_releases(async);
+
+	pthread_mutex_lock(&async->lock);
+	if (async->out_count == 0)
+	{
+		pthread_mutex_unlock(&async->lock);
+		async->polled.has_stats = 0;
+		async->polled.nnals = 0;
+		*pobuf = NULL;
+		*polen = 0;
+		*type = NONE;
+		*pots = 0;
+		return 0;
+	}
+
+	// swap the buffers, the slot reuses the one handed out last time
+	out = async->outs[async->out_head];
+	async->outs[async->out_head] = async->polled;
+	async->polled = out;
+	async->out_head = (async->out_head + 1) % async->nouts;
+	async->out_count--;
+	pthread_cond_broadcast(&async->out_cond);
+	pthread_mutex_unlock(&async->lock);
+
+	*pobuf = async->polled.buf;
+	*polen = async->polled.len;
+	*type = async->polled.type;
+	*pots = async->polled.ts;
+
+	return 1;
+}
+
+// the last value wins if it's set again before the next input
+static void queue_reconf(struct enc_async *async, int flag, int *field,
+		int val)
+{
+	pthread_mutex_lock(&async->lock);
+	async->reconf.flags |= flag;
+	if (field)
+		*field = val;
+	pthread_mutex_unlock(&async->lock);
+}
+
+void encode_async_set_qp(struct enc_async *async, int val)
+{
+	queue_reconf(async, RECONF_QP, &async->reconf.qp, val);
+}
+
+void encode_async_set_gop(struct enc_async *async, int val)
+{
+	queue_reconf(async, RECONF_GOP, &async->reconf.gop, val);
+}
+
+void encode_async_set_bitrate(struct enc_async *async, int val)
+{
+	queue_reconf(async, RECONF_BITRATE, &async->reconf.bitrate, val);
+}
+
+void encode_async_set_framerate(struct enc_async *async, int val)
+{
+	queue_reconf(async, RECONF_FRAMERATE, &async->reconf.framerate, val);
+}
+
+void encode_async_force_Ipic(struct enc_async *async)
+{
+	queue_reconf(async, RECONF_IPIC, NULL, 0);
+}
+
+int encode_async_get_stats(struct enc_async *async, struct enc_stats *stats)
+{
+	if (!async->polled.has_stats)
+		return -1;
+
+	*stats = async->polled.stats;
+	return 0;
+}
+
+int encode_async_get_nals(struct enc_async *async, const struct enc_nal **pnals,
+		int *pnnals)
+{
+	if (async->polled.nnals <= 0)
+		return -1;
+
+	*pnals = async->polled.nals;
+	*pnnals = async->polled.nnals;
+	return 0;
+}
@@ -24,20 +24,41 @@
 #include <assert.h>
 #include <linux/videodev2.h>
 #include <libswscale/swscale.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
 #include "ffmpeg_common.h"
 #include "camkit/convert.h"
+#include "slice_pool.h"
+#include "motion.h"
+
+#define MAX_SLICES 16
+#define SRC_ALIGN 16		// sws_scale() SIMD wants aligned lines, copy the input otherwise
+#define BAND_OVERLAP 8		// lines a band converts past its borders, more than the chroma filter reaches
 
 struct cvt_handle
 {
-	struct SwsContext *sws_ctx;
+	struct SwsContext *sws_ctx[MAX_SLICES];		// one for every band, sws_scale() can't start in the middle
+	int slice_y[MAX_SLICES + 1];		// first line of every band
+	int band_y[MAX_SLICES];		// first line converted by a band, slice_y less the overlap
+	uint8_t *band_data[MAX_SLICES][4];		// the converted band with the overlap, cropped into the output
+	int band_linesize[MAX_SLICES][4];
+	int nslices;
+	int in_place;		// 1: the bands write the output lines directly, no overlap needed
+	struct slice_pool *pool;
 	uint8_t *src_buffer;
 	int src_buffersize;
 	AVFrame *src_frame;
+	const uint8_t *in_data[4];		// where the slices read, the caller's buffer or src_frame
+	int in_linesize[4];
+	int in_copy;		// -1: not decided yet, 0: read in place, 1: copied into src_frame
 	uint8_t *dst_buffer;
 	int dst_buffersize;
 	AVFrame *dst_frame;
+	uint8_t *out_data[4];		// where the slices write, dst_frame or the caller's planes
+	int out_linesize[4];
 	enum AVPixelFormat inavfmt;
 	enum AVPixelFormat outavfmt;
+	struct motion_meter *motion;		// NULL if not measured
 
 	struct cvt_param params;
 };
@@ -68,6 +89,144 @@ static enum AVPixelFormat v4lFmt2AVFmt(U32 v4lfmt)
 	return avfmt;
 }
 
+// point the planes of a picture to its line y
+static void offset_planes(enum AVPixelFormat fmt, uint8_t * const *data,
+		const int *linesize, int y, uint8_t **odata)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+		odata[i] = data[i] ? data[i] + (y >> shift) * linesize[i] : NULL;
+	}
+}
+
+// let the slices read the input planes in place if they are aligned, else copy them
+static void set_input(struct cvt_handle *handle, const uint8_t * const *data,
+		const int *linesize)
+{
+	int copy = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (data[i]
+				&& (((uintptr_t) data[i] | linesize[i]) & (SRC_ALIGN - 1)))
+			copy = 1;
+	}
+
+	if (copy != handle->in_copy)
+	{
+		printf("+++ Convert input: %s\n",
+				copy ? "copied, not aligned" : "read in place");
+		handle->in_copy = copy;
+	}
+
+	if (copy)
+	{
+		av_image_copy(handle->src_frame->data, handle->src_frame->linesize,
+				(const uint8_t **) data, linesize, handle->inavfmt,
+				handle->params.inwidth, handle->params.inheight);
+		for (i = 0; i < 4; i++)
+		{
+			handle->in_data[i] = handle->src_frame->data[i];
+			handle->in_linesize[i] = handle->src_frame->linesize[i];
+		}
+	}
+	else
+	{
+		for (i = 0; i < 4; i++)
+		{
+			handle->in_data[i] = data[i];
+			handle->in_linesize[i] = linesize[i];
+		}
+	}
+}
+
+// the unscaled YUV converters of swscale work on line pairs, a band sees all it needs,
+// the RGB ones go through the vertical chroma filter like any scaled width
+static int bands_in_place(struct cvt_handle *handle)
+{
+	if (handle->nslices == 1 || handle->inavfmt == AV_PIX_FMT_YUV420P)
+		return 1;
+
+	return handle->inavfmt == AV_PIX_FMT_YUYV422
+			&& handle->params.inwidth == handle->params.outwidth;
+}
+
+static int band_end(struct cvt_handle *handle, int index)
+{
+	if (index == handle->nslices - 1)
+		return handle->params.inheight;
+	if (handle->in_place)
+		return handle->slice_y[index + 1];
+
+	return FFMIN(handle->slice_y[index + 1] + BAND_OVERLAP,
+			handle->params.inheight);
+}
+
+// compare the output luma of a band while it's in cache
+static void band_motion(struct cvt_handle *handle, int index)
+{
+	int starty = handle->slice_y[index];
+	int endy = handle->slice_y[index + 1];
+
+	if (!handle->motion)
+		return;
+	if (handle->nslices == 1)		// the height may be scaled
+		endy = handle->params.outheight;
+
+	motion_add(handle->motion,
+			motion_lines(handle->motion, handle->out_data[0],
+					handle->out_linesize[0], starty, endy));
+}
+
+static void convert_slice(void *arg, int index, int count)
+{
+	struct cvt_handle *handle = arg;
+	uint8_t *src[4], *dst[4], *band[4];
+	UNUSED(count);
+
+	offset_planes(handle->inavfmt, (uint8_t * const *) handle->in_data,
+			handle->in_linesize, handle->band_y[index], src);
+	offset_planes(handle->outavfmt, handle->out_data, handle->out_linesize,
+			handle->slice_y[index], dst);
+	if (handle->in_place)
+	{
+		sws_scale(handle->sws_ctx[index], (const uint8_t * const *) src,
+				handle->in_linesize, 0,
+				band_end(handle, index) - handle->band_y[index], dst,
+				handle->out_linesize);
+		band_motion(handle, index);
+		return;
+	}
+
+	// the overlap lines would overwrite the neighbours, so the band is cropped into the output
+	sws_scale(handle->sws_ctx[index], (const uint8_t * const *) src,
+			handle->in_linesize, 0,
+			band_end(handle, index) - handle->band_y[index],
+			handle->band_data[index], handle->band_linesize[index]);
+	offset_planes(handle->outavfmt, handle->band_data[index],
+			handle->band_linesize[index],
+			handle->slice_y[index] - handle->band_y[index], band);
+	av_image_copy(dst, handle->out_linesize, (const uint8_t **) band,
+			handle->band_linesize[index], handle->outavfmt,
+			handle->params.outwidth,
+			handle->slice_y[index + 1] - handle->slice_y[index]);
+	band_motion(handle, index);
+}
+
+static void run_slices(struct cvt_handle *handle)
+{
+	if (handle->motion)
+		motion_begin(handle->motion);
+	slice_pool_run(handle->pool, convert_slice, handle);
+	if (handle->motion)
+		motion_end(handle->motion);
+}
+
 struct cvt_handle *convert_open(struct cvt_param param)
 {
 	struct cvt_handle *handle = malloc(sizeof(struct cvt_handle));
@@ -78,10 +237,12 @@ struct cvt_handle *convert_open(struct cvt_param param)
 	}
 
 	CLEAR(*handle);
-	handle->sws_ctx = NULL;
+	handle->nslices = 0;
+	handle->pool = NULL;
 	handle->src_buffer = NULL;
 	handle->src_buffersize = 0;
 	handle->src_frame = NULL;
+	handle->in_copy = -1;
 	handle->dst_buffer = NULL;
 	handle->dst_buffersize = 0;
 	handle->dst_frame = NULL;
@@ -95,16 +256,72 @@ struct cvt_handle *convert_open(struct cvt_param param)
 	handle->params.outheight = param.outheight;
 	handle->params.outpixfmt = param.outpixfmt;
 	handle->outavfmt = v4lFmt2AVFmt(handle->params.outpixfmt);
+	handle->params.motion = param.motion;
+	handle->params.nthreads = param.nthreads;
+	if (handle->params.nthreads < 1)
+		handle->params.nthreads = 1;
+	if (handle->params.nthreads > MAX_SLICES)
+		handle->params.nthreads = MAX_SLICES;
+	if (handle->params.nthreads > 1
+			&& handle->params.inheight != handle->params.outheight)
+	{
+		// a band has no access to the lines of its neighbours, vertical scaling would show seams
+		printf("!!! Sliced convert needs the same in/out height, use 1 thread\n");
+		handle->params.nthreads = 1;
+	}
 
-	handle->sws_ctx = sws_getContext(handle->params.inwidth,
-			handle->params.inheight, handle->inavfmt, handle->params.outwidth,
-			handle->params.outheight, handle->outavfmt, SWS_BILINEAR, NULL,
-			NULL, NULL);
-	if (!handle->sws_ctx)
+	// bands of even lines for the 4:2:0 chroma
+	int i;
+	handle->nslices = handle->params.nthreads;
+	for (i = 0; i <= handle->nslices; i++)
+		handle->slice_y[i] = handle->params.inheight / 2 * i / handle->nslices
+				* 2;
+	handle->slice_y[handle->nslices] = handle->params.inheight;
+
+	// else a band also converts the lines next to it, so the vertical chroma filter
+	// sees the same lines as with a single context, instead of clamping at the band border
+	handle->in_place = bands_in_place(handle);
+	for (i = 0; i < handle->nslices; i++)
 	{
-		printf("--- Create scale context failed\n");
-		goto err0;
+		if (handle->in_place)
+		{
+			handle->band_y[i] = handle->slice_y[i];
+			continue;
+		}
+		handle->band_y[i] = FFMAX(handle->slice_y[i] - BAND_OVERLAP, 0);
+		if (av_image_alloc(handle->band_data[i], handle->band_linesize[i],
+				handle->params.outwidth,
+				band_end(handle, i) - handle->band_y[i], handle->outavfmt,
+				SRC_ALIGN) < 0)
+		{
+			printf("--- allocate band buffer failed\n");
+			goto err1;
+		}
+	}
+
+	for (i = 0; i < handle->nslices; i++)
+	{
+		int h = band_end(handle, i) - handle->band_y[i];
+		handle->sws_ctx[i] = sws_getContext(handle->params.inwidth,
+				handle->nslices > 1 ? h : handle->params.inheight,
+				handle->inavfmt, handle->params.outwidth,
+				handle->nslices > 1 ? h : handle->params.outheight,
+				handle->outavfmt, SWS_BILINEAR, NULL, NULL, NULL);
+		if (!handle->sws_ctx[i])
+		{
+			printf("--- Create scale context failed\n");
+			goto err1;
+		}
+	}
+
+	handle->pool = slice_pool_open(handle->nslices);
+	if (!handle->pool)
+	{
+		printf("--- open convert threads failed\n");
+		goto err1;
 	}
+	printf("+++ Convert threads: %d%s\n", handle->nslices,
+			handle->in_place ? "" : ", overlapped bands");
 
 	// alloc buffers
 	handle->src_frame = av_frame_alloc();
@@ -142,24 +359,50 @@ struct cvt_handle *convert_open(struct cvt_param param)
 			handle->outavfmt, handle->params.outwidth,
 			handle->params.outheight);
 
+	// the luma of the output is sampled
+	if (handle->params.motion && handle->outavfmt != AV_PIX_FMT_YUV420P)
+		printf("!!! Motion detection needs YUV420 output\n");
+	else if (handle->params.motion)
+	{
+		handle->motion = motion_open(handle->params.outwidth,
+				handle->params.outheight);
+		if (!handle->motion)
+			goto err5;
+	}
+
 	printf("+++ Convert Opened\n");
 	return handle;
 
+	err5: av_free(handle->dst_buffer);
 	err4: av_frame_free(&handle->dst_frame);
 	err3: av_free(handle->src_buffer);
 	err2: av_frame_free(&handle->src_frame);
-	err1: sws_freeContext(handle->sws_ctx);
-	err0: free(handle);
+	err1: if (handle->pool)
+		slice_pool_close(handle->pool);
+	for (i = 0; i < handle->nslices; i++)
+	{
+		sws_freeContext(handle->sws_ctx[i]);
+		av_freep(&handle->band_data[i][0]);
+	}
+	free(handle);
 	return NULL;
 }
 
 void convert_close(struct cvt_handle *handle)
 {
+	if (handle->motion)
+		motion_close(handle->motion);
 	av_free(handle->dst_buffer);
 	av_frame_free(&handle->dst_frame);
 	av_free(handle->src_buffer);
 	av_frame_free(&handle->src_frame);
-	sws_freeContext(handle->sws_ctx);
+	slice_pool_close(handle->pool);
+	int i;
+	for (i = 0; i < handle->nslices; i++)
+	{
+		sws_freeContext(handle->sws_ctx[i]);
+		av_freep(&handle->band_data[i][0]);
+	}
 	free(handle);
 	printf("+++ Convert Closed\n");
 }
@@ -167,15 +410,68 @@ void convert_close(struct cvt_handle *handle)
 int convert_do(struct cvt_handle *handle, const void *inbuf, int isize,
 		void **poutbuf, int *posize)
 {
+	AVPicture in;
+
 	assert(isize == handle->src_buffersize);
-	memcpy(handle->src_buffer, inbuf, isize);
-	sws_scale(handle->sws_ctx,
-			(const uint8_t * const *) handle->src_frame->data,
-			handle->src_frame->linesize, 0, handle->params.inheight,
-			handle->dst_frame->data, handle->dst_frame->linesize);
+	avpicture_fill(&in, (uint8_t *) inbuf, handle->inavfmt,
+			handle->params.inwidth, handle->params.inheight);
+	set_input(handle, (const uint8_t * const *) in.data, in.linesize);
+
+	memcpy(handle->out_data, handle->dst_frame->data, sizeof(handle->out_data));
+	memcpy(handle->out_linesize, handle->dst_frame->linesize,
+			sizeof(handle->out_linesize));
+	run_slices(handle);
 
 	*poutbuf = handle->dst_buffer;
 	*posize = handle->dst_buffersize;
 
 	return 0;
 }
+
+int convert_do_into(struct cvt_handle *handle, const struct cvt_planes *in,
+		const struct cvt_planes *out)
+{
+	const uint8_t *idata[4];
+	int ilinesize[4];
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		idata[i] = in->data[i];
+		ilinesize[i] = in->stride[i];
+		handle->out_data[i] = out->data[i];
+		handle->out_linesize[i] = out->stride[i];
+	}
+	idata[3] = NULL;
+	ilinesize[3] = 0;
+	handle->out_data[3] = NULL;
+	handle->out_linesize[3] = 0;
+
+	set_input(handle, idata, ilinesize);
+	run_slices(handle);
+
+	return 0;
+}
+
+int convert_do_multi(struct cvt_handle **handles, int n,
+		const struct cvt_planes *in, const struct cvt_planes *outs)
+{
+	int i;
+
+	// sws_scale() has a context per output, no shared pass, but the input is read in place if aligned
+	for (i = 0; i < n; i++)
+	{
+		if (convert_do_into(handles[i], in, &outs[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int convert_get_motion(struct cvt_handle *handle)
+{
+	if (!handle->motion)
+		return -1;
+
+	return motion_get_score(handle->motion);
+}
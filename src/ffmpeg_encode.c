@@ -22,22 +22,59 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include "ffmpeg_common.h"
 #include "camkit/encode.h"
 
+#define TS_QUEUE_SIZE 64	// must be power of 2, more than the frames the encoder may delay (frame threads + B frames)
+#define TIME_BASE 90000	// pts clock, frames are spaced by the current frame rate
+#define KEYINT_INFINITE (1 << 30)	// x264 never inserts IDR itself, see encode_frame()
+#define DEFAULT_CRF 23	// constant quality when there is no rate control
+#define MAX_TEMPORAL_LAYERS 3	// B-pyramid depth of x264
+
+// the capture timestamp of a frame in the encoder
+struct ts_t
+{
+	int64_t pts;
+	U64 ts;
+};
+
+// a caller buffer borrowed by encode_do_ref()
+struct ref_t
+{
+	enc_release_fn release;
+	void *opaque;
+};
+
 struct enc_handle
 {
 	AVCodec *codec;
 	AVCodecContext *ctx;
 	AVFrame *frame;
+	AVFrame *ref_frame;	// wraps the caller buffers, see encode_do_ref()
+	struct ref_t refs[TS_QUEUE_SIZE];	// indexed by frame_counter like ts_queue
 	uint8_t *inbuffer;
 	int inbufsize;
 	AVPacket packet;
 	unsigned long frame_counter;
+	struct ts_t ts_queue[TS_QUEUE_SIZE];	// input timestamps, indexed by frame_counter
+	int64_t next_pts;
+	int pts_step;		// TIME_BASE / fps
+	int since_key;		// frames since the last I-frame
+	U64 call_start;		// when the current encode call started, microsecond
+	struct enc_stats stats;		// of the last output frame
+	int has_stats;		// 0/1
 
 	struct enc_param params;
 };
 
+static U64 get_monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (U64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 struct enc_handle *encode_open(struct enc_param param)
 {
 	struct enc_handle *handle = malloc(sizeof(struct enc_handle));
@@ -51,9 +88,12 @@ struct enc_handle *encode_open(struct enc_param param)
 	handle->codec = NULL;
 	handle->ctx = NULL;
 	handle->frame = NULL;
+	handle->ref_frame = NULL;
 	handle->inbuffer = NULL;
 	handle->inbufsize = 0;
 	handle->frame_counter = 0;
+	handle->next_pts = 0;
+	handle->since_key = 0;
 	handle->params.src_picwidth = param.src_picwidth;
 	handle->params.src_picheight = param.src_picheight;
 	handle->params.enc_picwidth = param.enc_picwidth;
@@ -62,6 +102,29 @@ struct enc_handle *encode_open(struct enc_param param)
 	handle->params.bitrate = param.bitrate;
 	handle->params.gop = param.gop;
 	handle->params.chroma_interleave = param.chroma_interleave;
+	handle->params.max_b_frames = param.max_b_frames;
+	handle->params.max_slice_size = param.max_slice_size;
+	handle->params.intra_refresh = param.intra_refresh;
+	handle->params.thread_type = param.thread_type;
+	handle->params.threads = param.threads > 0 ? param.threads : 0;
+	handle->params.temporal_layers = param.temporal_layers;
+	if (handle->params.temporal_layers > MAX_TEMPORAL_LAYERS)
+	{
+		printf("!!! At most %d temporal layers, %d requested\n",
+				MAX_TEMPORAL_LAYERS, handle->params.temporal_layers);
+		handle->params.temporal_layers = MAX_TEMPORAL_LAYERS;
+	}
+	// x264 has no hierarchical P, the layers are made of B frames in fixed mini-gops:
+	// 2 layers: P b P b ..., 3 layers: P b B b P ..., the lowercase b are never referenced
+	if (handle->params.temporal_layers > 1)
+	{
+		int nb = (1 << (handle->params.temporal_layers - 1)) - 1;
+		if (handle->params.max_b_frames > 0 && handle->params.max_b_frames != nb)
+			printf("!!! %d temporal layers need %d B frames, not %d\n",
+					handle->params.temporal_layers, nb,
+					handle->params.max_b_frames);
+		handle->params.max_b_frames = nb;
+	}
 
 	avcodec_register_all();
 	handle->codec = avcodec_find_encoder(AV_CODEC_ID_H264);
@@ -78,27 +141,66 @@ struct enc_handle *encode_open(struct enc_param param)
 		goto err0;
 	}
 
-	handle->ctx->bit_rate = handle->params.bitrate * 1000;    // to kbps
+	handle->ctx->bit_rate = handle->params.bitrate * 1000;    // kbps to bps
+	// x264 takes a new bitrate at runtime only if it was opened with VBV, one second of buffer
+	if (handle->params.bitrate > 0)
+	{
+		handle->ctx->rc_max_rate = handle->ctx->bit_rate;
+		handle->ctx->rc_buffer_size = handle->ctx->bit_rate;
+	}
 	handle->ctx->width = handle->params.src_picwidth;
 	handle->ctx->height = handle->params.src_picheight;
+	// x264 rate control follows the pts, so the frame rate can change by the pts step
 	handle->ctx->time_base = (AVRational
 			)
-			{ 1, handle->params.fps };    // frames per second
-	handle->ctx->gop_size = handle->params.gop;
-	handle->ctx->max_b_frames = 1;
+			{ 1, TIME_BASE };
+	handle->ctx->framerate = (AVRational
+			)
+			{ handle->params.fps, 1 };    // frames per second
+	handle->pts_step = TIME_BASE / handle->params.fps;
+	// with intra refresh the gop is the refresh period, else I-frames are forced by encode_frame()
+	handle->ctx->gop_size =
+			handle->params.intra_refresh ? handle->params.gop : KEYINT_INFINITE;
+	handle->ctx->max_b_frames = handle->params.max_b_frames;    // overrides zerolatency
 	handle->ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-//	handle->ctx->thread_count = 1;
+	handle->ctx->thread_count = handle->params.threads;    // 0: x264 picks by the cores
+	handle->ctx->thread_type =
+			handle->params.thread_type == ENC_FRAME_THREADS ?
+					FF_THREAD_FRAME : FF_THREAD_SLICE;    // overrides zerolatency
 	// eliminate frame delay!
 	av_opt_set(handle->ctx->priv_data, "preset", "ultrafast", 0);
 	av_opt_set(handle->ctx->priv_data, "tune", "zerolatency", 0);
-	av_opt_set(handle->ctx->priv_data, "x264opts",
-			"no-mbtree:sliced-threads:sync-lookahead=0", 0);
+	char x264opts[128];
+	int n = snprintf(x264opts, sizeof(x264opts),
+			"no-mbtree:sync-lookahead=0");
+	if (handle->params.max_slice_size > 0)    // slices fit a packet, no FU-A
+		n += snprintf(x264opts + n, sizeof(x264opts) - n, ":slice-max-size=%d",
+				handle->params.max_slice_size);
+	if (handle->params.intra_refresh)    // the refresh takes gop frames, no IDR after the first one
+		n += snprintf(x264opts + n, sizeof(x264opts) - n, ":intra-refresh=1");
+	if (handle->params.temporal_layers > 1)    // fixed mini-gops, only the middle B of 3 layers is a reference
+		n += snprintf(x264opts + n, sizeof(x264opts) - n, ":b-adapt=0:b-pyramid=%s",
+				handle->params.temporal_layers > 2 ? "strict" : "none");
+	av_opt_set(handle->ctx->priv_data, "x264opts", x264opts, 0);
+	// constant quality, x264 takes a new crf at runtime but not a new constant qp
+	if (handle->params.bitrate == 0)
+		av_opt_set_double(handle->ctx->priv_data, "crf", DEFAULT_CRF, 0);
 
 	if (avcodec_open2(handle->ctx, handle->codec, NULL) < 0)
 	{
 		printf("--- Could not open codec\n");
 		goto err1;
 	}
+	const char *model =
+			handle->params.thread_type == ENC_FRAME_THREADS ? "frame" : "slice";
+	if (handle->params.threads > 0)
+		printf("+++ Encode threads: %d, %s threads\n", handle->params.threads,
+				model);
+	else
+		printf("+++ Encode threads: auto (by the cores), %s threads\n", model);
+	if (handle->params.temporal_layers > 1)
+		printf("+++ Temporal layers: %d, %d B frames between P frames, each a frame of delay\n",
+				handle->params.temporal_layers, handle->params.max_b_frames);
 
 	handle->frame = av_frame_alloc();
 	if (!handle->frame)
@@ -112,16 +214,25 @@ struct enc_handle *encode_open(struct enc_param param)
 	handle->frame->height = handle->ctx->height;
 	handle->inbufsize = avpicture_get_size(AV_PIX_FMT_YUV420P,
 			handle->params.src_picwidth, handle->params.src_picheight);
-	handle->inbuffer = av_malloc(handle->inbufsize);
-	if (!handle->inbuffer)
+	// refcounted, so avcodec_send_frame() takes a reference instead of a copy
+	handle->frame->buf[0] = av_buffer_alloc(handle->inbufsize);
+	if (!handle->frame->buf[0])
 	{
 		printf("--- Could not allocate inbuffer\n");
 		goto err3;
 	}
+	handle->inbuffer = handle->frame->buf[0]->data;
 	avpicture_fill((AVPicture *) handle->frame, handle->inbuffer,
 			AV_PIX_FMT_YUV420P, handle->params.src_picwidth,
 			handle->params.src_picheight);
 
+	handle->ref_frame = av_frame_alloc();
+	if (!handle->ref_frame)
+	{
+		printf("--- Could not allocate ref frame\n");
+		goto err3;
+	}
+
 	av_init_packet(&handle->packet);
 	handle->packet.data = NULL;
 	handle->packet.size = 0;
@@ -138,32 +249,136 @@ struct enc_handle *encode_open(struct enc_param param)
 
 void encode_close(struct enc_handle *handle)
 {
-	av_free_packet(&handle->packet);
-	av_free(handle->inbuffer);
-	av_frame_free(&handle->frame);
+	av_packet_unref(&handle->packet);
+	av_frame_free(&handle->frame);		// frees inbuffer
+	av_frame_free(&handle->ref_frame);
 	avcodec_close(handle->ctx);
 	av_free(handle->ctx);
 	free(handle);
 	printf("+++ Encode Closed\n");
 }
 
+int encode_get_inbuf(struct enc_handle *handle, void **pbuf, int *plen)
+{
+	*pbuf = handle->inbuffer;
+	*plen = handle->inbufsize;
+
+	return 0;
+}
+
 int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 		int *polen, enum pic_t *type)
 {
-	int got_output, ret;
+	U64 ots;
+	return encode_do_ts(handle, ibuf, ilen, 0, pobuf, polen, type, &ots);
+}
 
-	// reinit pkt
-	av_free_packet(&handle->packet);
-	av_init_packet(&handle->packet);
-	handle->packet.data = NULL;
-	handle->packet.size = 0;
+static void release_ref(void *opaque, uint8_t *data)
+{
+	struct ref_t *ref = opaque;
+	ref->release(ref->opaque, data);
+}
 
-	assert(handle->inbufsize == ilen);
-	memcpy(handle->inbuffer, ibuf, ilen);
-	handle->frame->pts = handle->frame_counter++;
+static U64 find_ts(struct enc_handle *handle, int64_t pts)
+{
+	int i;
+
+	for (i = 0; i < TS_QUEUE_SIZE; i++)
+	{
+		if (handle->ts_queue[i].pts == pts)
+			return handle->ts_queue[i].ts;
+	}
+
+	return 0;
+}
+
+// fetch a ready packet, returns 1 if got one, 0 if none, -1 if error
+static int receive_packet(struct enc_handle *handle, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	int ret, size;
+	uint8_t *stats;
+
+	*pobuf = NULL;
+	*polen = 0;
+	*type = NONE;
+	*pots = 0;
+
+	av_packet_unref(&handle->packet);
+	ret = avcodec_receive_packet(handle->ctx, &handle->packet);
+	if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+		return 0;
+	if (ret < 0)
+	{
+		printf("--- Error receiving packet\n");
+		return -1;
+	}
+
+	*pobuf = handle->packet.data;
+	*polen = handle->packet.size;
+	*pots = find_ts(handle, handle->packet.pts);
+
+	// quality stats: quality (32 bits), then the picture type
+	stats = av_packet_get_side_data(&handle->packet, AV_PKT_DATA_QUALITY_STATS,
+			&size);
+	switch (stats && size >= 5 ? stats[4] : AV_PICTURE_TYPE_NONE)
+	{
+		case AV_PICTURE_TYPE_I:
+			*type = I;
+			break;
+		case AV_PICTURE_TYPE_P:
+			*type = P;
+			break;
+		case AV_PICTURE_TYPE_B:
+			*type = B;
+			break;
+		default:
+			*type = (handle->packet.flags & AV_PKT_FLAG_KEY) ? I : NONE;
+			break;
+	}
+
+	// the quality is the average qp in lambda units, little endian
+	int quality = -FF_QP2LAMBDA;    // qp -1 if not reported
+	if (stats && size >= 4)
+		quality = stats[0] | stats[1] << 8 | stats[2] << 16 | stats[3] << 24;
+
+	handle->stats.encode_usec = get_monotonic_usec() - handle->call_start;
+	handle->stats.bytes = handle->packet.size;
+	handle->stats.qp = quality / FF_QP2LAMBDA;
+	handle->stats.type = *type;
+	handle->stats.keyframe = (handle->packet.flags & AV_PKT_FLAG_KEY) != 0;
+	handle->stats.timestamp = *pots;
+	handle->has_stats = 1;
+
+	return 1;
+}
+
+static int encode_frame(struct enc_handle *handle, AVFrame *frame, U64 its,
+		void **pobuf, int *polen, enum pic_t *type, U64 *pots)
+{
+	int ret;
+
+	handle->call_start = get_monotonic_usec();
+	struct ts_t *ts = &handle->ts_queue[handle->frame_counter++
+			& (TS_QUEUE_SIZE - 1)];
 
-	ret = avcodec_encode_video2(handle->ctx, &handle->packet, handle->frame,
-			&got_output);
+	frame->pts = handle->next_pts;
+	handle->next_pts += handle->pts_step;
+	ts->pts = frame->pts;
+	ts->ts = its;
+
+	// gop, x264 can't change its keyint at runtime
+	if (!handle->params.intra_refresh && handle->params.gop > 0
+			&& handle->since_key >= handle->params.gop)
+	{
+		frame->pict_type = AV_PICTURE_TYPE_I;
+		frame->key_frame = 1;
+	}
+	if (frame->pict_type == AV_PICTURE_TYPE_I)
+		handle->since_key = 0;
+	handle->since_key++;
+
+	ret = avcodec_send_frame(handle->ctx, frame);
 	// cancel key frame
 	handle->frame->pict_type = 0;
 	handle->frame->key_frame = 0;
@@ -173,37 +388,94 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 		return -1;
 	}
 
-	if (got_output)
+	// the first ready packet, the others by encode_get_packet()
+	return receive_packet(handle, pobuf, polen, type, pots) < 0 ? -1 : 0;
+}
+
+int encode_do_ts(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		void **pobuf, int *polen, enum pic_t *type, U64 *pots)
+{
+	assert(handle->inbufsize == ilen);
+	if (ibuf != handle->inbuffer)	// already there if filled via encode_get_inbuf()
+		memcpy(handle->inbuffer, ibuf, ilen);
+
+	return encode_frame(handle, handle->frame, its, pobuf, polen, type, pots);
+}
+
+int encode_do_ref(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		enc_release_fn release, void *opaque, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	AVFrame *frame = handle->ref_frame;
+	struct ref_t *ref = &handle->refs[handle->frame_counter
+			& (TS_QUEUE_SIZE - 1)];
+	int ret;
+
+	assert(handle->inbufsize == ilen);
+	ref->release = release;
+	ref->opaque = opaque;
+
+	// the encoder keeps its own reference while it needs the picture, the last unref gives ibuf back
+	frame->buf[0] = av_buffer_create(ibuf, ilen, release_ref, ref,
+			AV_BUFFER_FLAG_READONLY);
+	if (!frame->buf[0])
 	{
-		*pobuf = handle->packet.data;
-		*polen = handle->packet.size;
-		switch (handle->ctx->coded_frame->pict_type)
-		{
-			case AV_PICTURE_TYPE_I:
-				*type = I;
-				break;
-			case AV_PICTURE_TYPE_P:
-				*type = P;
-				break;
-			case AV_PICTURE_TYPE_B:
-				*type = B;
-				break;
-			default:
-				*type = NONE;
-				break;
-		}
+		printf("--- Could not wrap the input buffer\n");
+		release(opaque, ibuf);
+		return -1;
 	}
-	else	// get the delayed frame
+	frame->format = handle->frame->format;
+	frame->width = handle->frame->width;
+	frame->height = handle->frame->height;
+	frame->pict_type = handle->frame->pict_type;
+	frame->key_frame = handle->frame->key_frame;
+	avpicture_fill((AVPicture *) frame, ibuf, AV_PIX_FMT_YUV420P,
+			handle->params.src_picwidth, handle->params.src_picheight);
+
+	ret = encode_frame(handle, frame, its, pobuf, polen, type, pots);
+	av_frame_unref(frame);
+
+	return ret;
+}
+
+int encode_get_packet(struct enc_handle *handle, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	handle->call_start = get_monotonic_usec();
+	return receive_packet(handle, pobuf, polen, type, pots);
+}
+
+int encode_flush(struct enc_handle *handle)
+{
+	int ret = avcodec_send_frame(handle->ctx, NULL);
+	if (ret < 0 && ret != AVERROR_EOF)
 	{
-		printf("!!! encoded frame delayed!\n");
-		*pobuf = NULL;
-		*polen = 0;
-		*type = NONE;
+		printf("--- Error flushing encoder\n");
+		return -1;
 	}
 
 	return 0;
 }
 
+int encode_get_stats(struct enc_handle *handle, struct enc_stats *stats)
+{
+	if (!handle->has_stats)
+		return -1;
+
+	*stats = handle->stats;
+	return 0;
+}
+
+int encode_get_nals(struct enc_handle *handle, const struct enc_nal **pnals,
+		int *pnnals)
+{
+	// libavcodec joins the NALUs x264 made into one packet, their boundaries are gone
+	UNUSED(handle);
+	UNUSED(pnals);
+	UNUSED(pnnals);
+	return -1;
+}
+
 int encode_get_headers(struct enc_handle *handle, void **pbuf, int *plen,
 		enum pic_t *type)
 {
@@ -216,24 +488,54 @@ int encode_get_headers(struct enc_handle *handle, void **pbuf, int *plen,
 
 int encode_set_qp(struct enc_handle *handle, int val)
 {
-	UNUSED(handle);
-	UNUSED(val);
-	printf("*** %s.%s: This function is not implemented\n", __FILE__,
-			__FUNCTION__);
-	return -1;
+	if (handle->params.bitrate != 0)
+	{
+		printf("!!! qp is used only when rate control is disabled\n");
+		return -1;
+	}
+
+	// as the crf, libavcodec reconfigures x264 with it before the next frame
+	return av_opt_set_double(handle->ctx->priv_data, "crf", val, 0) < 0 ? -1 : 0;
+}
+
+int encode_set_gop(struct enc_handle *handle, int val)
+{
+	if (handle->params.intra_refresh)
+	{
+		printf("!!! gop can't be changed with intra refresh\n");
+		return -1;
+	}
+
+	handle->params.gop = val;
+	return 0;
 }
 
 int encode_set_bitrate(struct enc_handle *handle, int val)
 {
-	handle->ctx->bit_rate = val;
+	if (handle->params.bitrate == 0)
+	{
+		printf("!!! No rate control, the encoder was opened with bitrate 0\n");
+		return -1;
+	}
+	if (val <= 0)
+		return -1;
+
+	// libavcodec reconfigures x264 with it before the next frame, no IDR
+	handle->params.bitrate = val;
+	handle->ctx->bit_rate = val * 1000;    // kbps to bps
+	handle->ctx->rc_max_rate = handle->ctx->bit_rate;
+	handle->ctx->rc_buffer_size = handle->ctx->bit_rate;
 	return 0;
 }
 
 int encode_set_framerate(struct enc_handle *handle, int val)
 {
-	handle->ctx->time_base = (AVRational
-			)
-			{ 1, val };
+	if (val <= 0)
+		return -1;
+
+	// the next frames are spaced by the new rate, the rate control gives them bits by the pts
+	handle->params.fps = val;
+	handle->pts_step = TIME_BASE / val;
 	return 0;
 }
 
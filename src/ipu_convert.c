@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <linux/ipu.h>
 #include "camkit/convert.h"
 
@@ -88,6 +89,31 @@ static unsigned int fmt2bpp(unsigned int pixelformat)
 	return bpp;
 }
 
+// lines of every plane of a picture, returns the number of planes
+static int fmt2planes(unsigned int pixelformat, int width, int height,
+		int *linebytes, int *lines)
+{
+	switch (pixelformat)
+	{
+		case IPU_PIX_FMT_YUV420P:
+		case IPU_PIX_FMT_YVU420P:
+			linebytes[0] = width;
+			lines[0] = height;
+			linebytes[1] = linebytes[2] = width / 2;
+			lines[1] = lines[2] = height / 2;
+			return 3;
+		case IPU_PIX_FMT_NV12:
+			linebytes[0] = linebytes[1] = width;
+			lines[0] = height;
+			lines[1] = height / 2;
+			return 2;
+		default:
+			linebytes[0] = width * fmt2bpp(pixelformat) / 8;
+			lines[0] = height;
+			return 1;
+	}
+}
+
 struct cvt_handle *convert_open(struct cvt_param param)
 {
 	struct cvt_handle *handle = malloc(sizeof(struct cvt_handle));
@@ -105,6 +131,9 @@ struct cvt_handle *convert_open(struct cvt_param param)
 	handle->params.outwidth = param.outwidth;
 	handle->params.outheight = param.outheight;
 	handle->params.outpixfmt = param.outpixfmt;
+	handle->params.motion = param.motion;
+	if (handle->params.motion)
+		printf("!!! Motion detection is not supported by the ipu converter\n");
 
 	int ret;
 
@@ -251,3 +280,68 @@ int convert_do(struct cvt_handle *handle, const void *ibuf, int ilen,
 
 	return 0;
 }
+
+int convert_do_into(struct cvt_handle *handle, const struct cvt_planes *in,
+		const struct cvt_planes *out)
+{
+	int linebytes[3], lines[3];
+	int nplanes, i, j;
+	uint8_t *buf;
+
+	// the ipu only reaches its own physical buffers, copy by lines on both sides
+	buf = handle->ipu_inbuf;
+	nplanes = fmt2planes(handle->task.input.format, handle->task.input.width,
+			handle->task.input.height, linebytes, lines);
+	for (i = 0; i < nplanes; i++)
+	{
+		for (j = 0; j < lines[i]; j++)
+		{
+			memcpy(buf, (const uint8_t *) in->data[i] + j * in->stride[i],
+					linebytes[i]);
+			buf += linebytes[i];
+		}
+	}
+
+	int ret = ioctl(handle->fd, IPU_QUEUE_TASK, &handle->task);
+	if (ret < 0)
+	{
+		printf("--- ipu convert failed\n");
+		return -1;
+	}
+
+	buf = handle->ipu_outbuf;
+	nplanes = fmt2planes(handle->task.output.format, handle->task.output.width,
+			handle->task.output.height, linebytes, lines);
+	for (i = 0; i < nplanes; i++)
+	{
+		for (j = 0; j < lines[i]; j++)
+		{
+			memcpy((uint8_t *) out->data[i] + j * out->stride[i], buf,
+					linebytes[i]);
+			buf += linebytes[i];
+		}
+	}
+
+	return 0;
+}
+
+int convert_do_multi(struct cvt_handle **handles, int n,
+		const struct cvt_planes *in, const struct cvt_planes *outs)
+{
+	int i;
+
+	// the ipu does a task per output
+	for (i = 0; i < n; i++)
+	{
+		if (convert_do_into(handles[i], in, &outs[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int convert_get_motion(struct cvt_handle *handle)
+{
+	UNUSED(handle);
+	return -1;
+}
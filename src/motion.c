@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "camkit/comdef.h"
+#include "motion.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/**
+ * count the blocks of a luma line that differ from the same line of the
+ * previous frame more than the noise, and keep the line for the next frame
+ */
+typedef int (*motion_row_fn)(const uint8_t *cur, uint8_t *ref, int width);
+
+#define MOTION_STEP 4		// a luma line of every 4 is sampled
+#define MOTION_BLOCK 16		// pixels of a sampled block
+#define MOTION_NOISE 6		// mean absolute difference of a still block, the sensor noise
+#define MOTION_SAD (MOTION_BLOCK * MOTION_NOISE)
+
+struct motion_meter
+{
+	motion_row_fn motion_row;
+	int width;
+	uint8_t *ref;		// the sampled luma lines of the previous frame
+	int blocks;		// sampled blocks of a frame
+	int changed;		// changed blocks of the current frame, summed by the slices
+	int score;		// of the last frame, per mille
+	unsigned long frames;
+};
+
+static int motion_row_c(const uint8_t *cur, uint8_t *ref, int width)
+{
+	int x, k, changed = 0;
+
+	for (x = 0; x + MOTION_BLOCK <= width; x += MOTION_BLOCK)
+	{
+		int sad = 0;
+		for (k = x; k < x + MOTION_BLOCK; k++)
+		{
+			sad += abs(cur[k] - ref[k]);
+			ref[k] = cur[k];
+		}
+		changed += sad > MOTION_SAD;
+	}
+
+	return changed;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static int motion_row_sse2(const uint8_t *cur, uint8_t *ref, int width)
+{
+	const __m128i thresh = _mm_set1_epi16(MOTION_SAD);
+	int x, k, changed = 0;
+
+	// psadbw sums the halves of a block, 4 blocks are compared at once
+	for (x = 0; x + 4 * MOTION_BLOCK <= width; x += 4 * MOTION_BLOCK)
+	{
+		__m128i sad[4];
+		for (k = 0; k < 4; k++)
+		{
+			const int o = x + k * MOTION_BLOCK;
+			__m128i c = _mm_loadu_si128((const __m128i *) (cur + o));
+			sad[k] = _mm_sad_epu8(c, _mm_loadu_si128((const __m128i *) (ref + o)));
+			_mm_storeu_si128((__m128i *) (ref + o), c);
+		}
+		__m128i ab = _mm_add_epi32(_mm_unpacklo_epi64(sad[0], sad[1]),
+				_mm_unpackhi_epi64(sad[0], sad[1]));
+		__m128i cd = _mm_add_epi32(_mm_unpacklo_epi64(sad[2], sad[3]),
+				_mm_unpackhi_epi64(sad[2], sad[3]));
+		// a 16 bits word per block and a zero one, 2 mask bits per word
+		__m128i gt = _mm_cmpgt_epi16(_mm_packs_epi32(ab, cd), thresh);
+		changed += __builtin_popcount(_mm_movemask_epi8(gt)) / 2;
+	}
+
+	for (; x + MOTION_BLOCK <= width; x += MOTION_BLOCK)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *) (cur + x));
+		__m128i sad = _mm_sad_epu8(c, _mm_loadu_si128((const __m128i *) (ref + x)));
+		sad = _mm_add_epi32(sad, _mm_srli_si128(sad, 8));
+		changed += _mm_cvtsi128_si32(sad) > MOTION_SAD;
+		_mm_storeu_si128((__m128i *) (ref + x), c);
+	}
+
+	return changed;
+}
+#endif
+
+#ifdef HAVE_NEON
+static int motion_row_neon(const uint8_t *cur, uint8_t *ref, int width)
+{
+	int x, changed = 0;
+
+	for (x = 0; x + MOTION_BLOCK <= width; x += MOTION_BLOCK)
+	{
+		uint8x16_t c = vld1q_u8(cur + x);
+		uint64x2_t sad = vpaddlq_u32(
+				vpaddlq_u16(vpaddlq_u8(vabdq_u8(c, vld1q_u8(ref + x)))));
+		changed += (int) (vgetq_lane_u64(sad, 0) + vgetq_lane_u64(sad, 1))
+				> MOTION_SAD;
+		vst1q_u8(ref + x, c);
+	}
+
+	return changed;
+}
+#endif
+
+static motion_row_fn select_motion_row(const char **name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		*name = "sse2";
+		return motion_row_sse2;
+	}
+#endif
+
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	*name = "neon";
+	return motion_row_neon;
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+	{
+		*name = "neon";
+		return motion_row_neon;
+	}
+#endif
+#endif
+
+	*name = "c";
+	return motion_row_c;
+}
+
+struct motion_meter *motion_open(int width, int height)
+{
+	struct motion_meter *meter = malloc(sizeof(struct motion_meter));
+	const char *kernel;
+	if (!meter)
+	{
+		printf("--- malloc motion meter failed\n");
+		return NULL;
+	}
+
+	CLEAR(*meter);
+	meter->width = width;
+	meter->blocks = (height + MOTION_STEP - 1) / MOTION_STEP
+			* (width / MOTION_BLOCK);
+	if (meter->blocks == 0)
+	{
+		printf("!!! Image too small for motion detection\n");
+		return meter;
+	}
+
+	meter->ref = calloc((height + MOTION_STEP - 1) / MOTION_STEP, width);
+	if (!meter->ref)
+	{
+		printf("--- malloc motion lines failed\n");
+		free(meter);
+		return NULL;
+	}
+	meter->motion_row = select_motion_row(&kernel);
+	printf("+++ Motion detection kernel: %s\n", kernel);
+
+	return meter;
+}
+
+void motion_close(struct motion_meter *meter)
+{
+	free(meter->ref);
+	free(meter);
+}
+
+void motion_begin(struct motion_meter *meter)
+{
+	meter->changed = 0;
+}
+
+int motion_line(struct motion_meter *meter, const uint8_t *line, int y)
+{
+	if (!meter->ref || y % MOTION_STEP != 0)
+		return 0;
+
+	return meter->motion_row(line, meter->ref + y / MOTION_STEP * meter->width,
+			meter->width);
+}
+
+int motion_lines(struct motion_meter *meter, const uint8_t *luma, int stride,
+		int starty, int endy)
+{
+	int y, changed = 0;
+
+	for (y = (starty + MOTION_STEP - 1) / MOTION_STEP * MOTION_STEP; y < endy;
+			y += MOTION_STEP)
+		changed += motion_line(meter, luma + y * stride, y);
+
+	return changed;
+}
+
+void motion_add(struct motion_meter *meter, int changed)
+{
+	if (changed)
+		__sync_fetch_and_add(&meter->changed, changed);
+}
+
+void motion_end(struct motion_meter *meter)
+{
+	if (!meter->ref)
+		return;
+
+	if (meter->frames++ == 0)    // nothing to compare with
+		meter->score = 1000;
+	else
+		meter->score = meter->changed * 1000 / meter->blocks;
+}
+
+int motion_get_score(struct motion_meter *meter)
+{
+	if (!meter->ref || meter->frames == 0)
+		return -1;
+
+	return meter->score;
+}
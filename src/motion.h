@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MOTION_H
+#define MOTION_H
+#include <stdint.h>
+
+/**< motion of the converted frames, the sampled luma lines are compared to the previous frame */
+struct motion_meter;
+
+/**
+ * @brief Allocate the sampled lines of the previous frame
+ * A picture with no whole block never scores, see motion_get_score().
+ * @param width the luma width
+ * @param height the luma height
+ * @return the meter handle, NULL if error
+ */
+struct motion_meter *motion_open(int width, int height);
+
+/**
+ * @brief Free the meter
+ * @param meter the meter handle
+ */
+void motion_close(struct motion_meter *meter);
+
+/**
+ * @brief Start a frame, before its lines are compared
+ * @param meter the meter handle
+ */
+void motion_begin(struct motion_meter *meter);
+
+/**
+ * @brief Compare a luma line if it's sampled, while it's still in cache
+ * @param meter the meter handle
+ * @param line the luma line
+ * @param y the line number
+ * @return the changed blocks of the line, 0 if it's not sampled
+ */
+int motion_line(struct motion_meter *meter, const uint8_t *line, int y);
+
+/**
+ * @brief Compare the sampled lines of a band of the luma plane
+ * @param meter the meter handle
+ * @param luma the luma plane
+ * @param stride bytes per luma line
+ * @param starty the first line of the band
+ * @param endy the line after the band
+ * @return the changed blocks of the band
+ */
+int motion_lines(struct motion_meter *meter, const uint8_t *luma, int stride,
+		int starty, int endy);
+
+/**
+ * @brief Add the changed blocks of a band to the frame, from any thread
+ * @param meter the meter handle
+ * @param changed the changed blocks
+ */
+void motion_add(struct motion_meter *meter, int changed);
+
+/**
+ * @brief Finish a frame and score it
+ * @param meter the meter handle
+ */
+void motion_end(struct motion_meter *meter);
+
+/**
+ * @brief Get the score of the last frame, see convert_get_motion()
+ * @param meter the meter handle
+ * @return the score 0-1000 (per mille), < 0 if no frame is scored yet
+ */
+int motion_get_score(struct motion_meter *meter);
+
+#endif
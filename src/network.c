@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define _GNU_SOURCE		// sendmmsg
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,6 +34,8 @@ struct net_handle
     int sktfd;
     struct sockaddr_in server_sock;
     int sersock_len;
+    struct mmsghdr *msgs;		// of net_send_batch()
+    int nmsgs;
 
     struct net_param params;
 };
@@ -87,6 +90,7 @@ struct net_handle *net_open(struct net_param params)
 void net_close(struct net_handle *handle)
 {
     close(handle->sktfd);
+    free(handle->msgs);
     free(handle);
     printf("+++ Network Closed\n");
 }
@@ -96,6 +100,52 @@ int net_send(struct net_handle *handle, void *data, int size)
     return send(handle->sktfd, data, size, 0);
 }
 
+int net_sendv(struct net_handle *handle, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    CLEAR(msg);    // connected, no address
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(handle->sktfd, &msg, 0);
+}
+
+int net_send_batch(struct net_handle *handle, const struct pac_pkt *pkts,
+        int npkts)
+{
+    int i, sent = 0;
+
+    if (npkts > handle->nmsgs)    // grows once to the largest batch
+    {
+        struct mmsghdr *msgs = realloc(handle->msgs, npkts * sizeof(*msgs));
+        if (!msgs)
+        {
+            printf("--- malloc %d messages failed\n", npkts);
+            return -1;
+        }
+        handle->msgs = msgs;
+        handle->nmsgs = npkts;
+    }
+
+    for (i = 0; i < npkts; i++)
+    {
+        CLEAR(handle->msgs[i]);    // connected, no address
+        handle->msgs[i].msg_hdr.msg_iov = (struct iovec *) pkts[i].iov;
+        handle->msgs[i].msg_hdr.msg_iovlen = pkts[i].iovcnt;
+    }
+
+    // the kernel may take only a part of them
+    while (sent < npkts)
+    {
+        int ret = sendmmsg(handle->sktfd, handle->msgs + sent, npkts - sent, 0);
+        if (ret <= 0)
+            return sent > 0 ? sent : -1;
+        sent += ret;
+    }
+
+    return sent;
+}
+
 int net_recv(struct net_handle *handle, void *data, int size)
 {
     return recv(handle->sktfd, data, size, 0);
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include <bcm_host.h>
 #include <ilclient.h>
 #include "camkit/encode.h"
@@ -39,10 +40,82 @@ struct enc_handle
 	void *combination_buffer;
 	unsigned long combination_buffer_ptr;
 	unsigned long frame_counter;
+	struct enc_stats stats;		// of the last frame
+	int has_stats;		// 0/1
+	int separate_nals;		// 0/1, every output buffer holds one NALU or a part of it
+	struct enc_nal nals[ENC_MAX_NALS];		// of the last frame
+	int nnals;		// < 0 if not known
+	int nal_open;		// 0/1, the last NALU goes on in the next buffer
 
 	struct enc_param params;
 };
 
+static U64 get_monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (U64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the encoder makes no B frames, a frame is I if it's a sync frame or has an IDR slice
+static enum pic_t frame_type(const unsigned char *buf, int len, OMX_U32 flags)
+{
+	int i;
+
+	if (flags & OMX_BUFFERFLAG_SYNCFRAME)
+		return I;
+
+	for (i = 0; i + 3 < len; i++)
+	{
+		if (buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1)
+		{
+			int nal_type = buf[i + 3] & 0x1f;
+			if (nal_type == 5)
+				return I;
+			if (nal_type == 1)
+				return P;
+			i += 2;
+		}
+	}
+
+	return NONE;
+}
+
+static int start_code_len(const unsigned char *buf, int len)
+{
+	if (len > 4 && buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == 1)
+		return 4;
+	if (len > 3 && buf[0] == 0 && buf[1] == 0 && buf[2] == 1)
+		return 3;
+	return 0;
+}
+
+// note the NALU of an output buffer appended to the frame at offset
+static void add_nal(struct enc_handle *handle, const unsigned char *buf, int len,
+		int offset, OMX_U32 flags)
+{
+	if (handle->nnals < 0 || len <= 0)    // not known for the frame, or nothing
+		return;
+
+	if (handle->nal_open)
+		handle->nals[handle->nnals - 1].size += len;
+	else
+	{
+		int sc = start_code_len(buf, len);
+		if (!sc || handle->nnals == ENC_MAX_NALS)
+		{
+			handle->nnals = -1;
+			return;
+		}
+
+		struct enc_nal *nal = &handle->nals[handle->nnals++];
+		nal->offset = offset + sc;
+		nal->size = len - sc;
+		nal->type = buf[sc] & 0x1f;
+	}
+	handle->nal_open = !(flags & OMX_BUFFERFLAG_ENDOFNAL);
+}
+
 static void print_def(OMX_PARAM_PORTDEFINITIONTYPE def)
 {
 	printf("+++ Def - Port %u: %s %u/%u %u %u %s,%s,%s %ux%u %ux%u @%u %u\n",
@@ -86,6 +159,15 @@ struct enc_handle *encode_open(struct enc_param param)
 	handle->params.bitrate = param.bitrate;
 	handle->params.gop = param.gop;
 	handle->params.chroma_interleave = param.chroma_interleave;
+	handle->params.max_slice_size = param.max_slice_size;
+	handle->params.intra_refresh = param.intra_refresh;
+	handle->params.thread_type = param.thread_type;
+	handle->params.threads = param.threads;    // hardware encoder, no threads to set
+	handle->params.temporal_layers = param.temporal_layers;
+	if (handle->params.temporal_layers > 1)
+		printf("!!! Temporal layers are not supported, every frame is a reference\n");
+	if (handle->params.max_slice_size > 0)
+		printf("!!! Slice size limit is not supported, one slice per frame\n");
 
 	bcm_host_init();
 
@@ -173,7 +255,7 @@ struct enc_handle *encode_open(struct enc_param param)
 	bitrateType.nSize = sizeof(OMX_VIDEO_PARAM_BITRATETYPE);
 	bitrateType.nVersion.nVersion = OMX_VERSION;
 	bitrateType.eControlRate = OMX_Video_ControlRateVariable;
-	bitrateType.nTargetBitrate = handle->params.bitrate * 1000;    // to kbps
+	bitrateType.nTargetBitrate = handle->params.bitrate * 1000;    // kbps to bps
 	bitrateType.nPortIndex = OMX_VIDENC_OUTPUT_PORT;
 
 	ret = OMX_SetParameter(ILC_GET_HANDLE(handle->video_encode),
@@ -218,6 +300,19 @@ struct enc_handle *encode_open(struct enc_param param)
 		goto err3;
 	}
 
+	// one NALU per output buffer, so the NALUs of a frame are known without scanning it
+	OMX_CONFIG_BOOLEANTYPE nalsSeparate;
+	memset(&nalsSeparate, 0, sizeof(OMX_CONFIG_BOOLEANTYPE));
+	nalsSeparate.nSize = sizeof(OMX_CONFIG_BOOLEANTYPE);
+	nalsSeparate.nVersion.nVersion = OMX_VERSION;
+	nalsSeparate.bEnabled = OMX_TRUE;
+
+	ret = OMX_SetParameter(ILC_GET_HANDLE(handle->video_encode),
+			OMX_IndexParamBrcmNALSSeparate, &nalsSeparate);
+	if (ret != OMX_ErrorNone)
+		printf("!!! OMX_SetParameter for separate NALs failed, NALUs are not reported\n");
+	handle->separate_nals = ret == OMX_ErrorNone;
+
 	// get current settings of avcConfig
 	OMX_VIDEO_PARAM_AVCTYPE avcConfig;
 	memset(&avcConfig, 0, sizeof(OMX_VIDEO_PARAM_AVCTYPE));
@@ -256,6 +351,28 @@ struct enc_handle *encode_open(struct enc_param param)
 	}
 	printf("+++ nPFrames set to: %u\n", avcConfig.nPFrames);
 
+	// cyclic intra refresh, the whole picture in gop frames
+	if (handle->params.intra_refresh && handle->params.gop > 0)
+	{
+		OMX_VIDEO_PARAM_INTRAREFRESHTYPE refresh;
+		memset(&refresh, 0, sizeof(OMX_VIDEO_PARAM_INTRAREFRESHTYPE));
+		refresh.nSize = sizeof(OMX_VIDEO_PARAM_INTRAREFRESHTYPE);
+		refresh.nVersion.nVersion = OMX_VERSION;
+		refresh.nPortIndex = OMX_VIDENC_OUTPUT_PORT;
+		refresh.eRefreshMode = OMX_VIDEO_IntraRefreshCyclic;
+		refresh.nCirMBs = (((handle->params.src_picwidth + 15) / 16)
+				* ((handle->params.src_picheight + 15) / 16)
+				+ handle->params.gop - 1) / handle->params.gop;
+
+		ret = OMX_SetParameter(ILC_GET_HANDLE(handle->video_encode),
+				OMX_IndexParamVideoIntraRefresh, &refresh);
+		if (ret != OMX_ErrorNone)
+			printf("!!! OMX_SetParameter for intra refresh failed with %x\n",
+					ret);
+		else
+			printf("+++ Intra refresh: %u MBs per frame\n", refresh.nCirMBs);
+	}
+
 	// change il state
 	if (ilclient_change_component_state(handle->video_encode, OMX_StateIdle)
 			== -1)
@@ -325,13 +442,33 @@ void encode_close(struct enc_handle *handle)
 	printf("+++ Encode Closed\n");
 }
 
+int encode_get_inbuf(struct enc_handle *handle, void **pbuf, int *plen)
+{
+	// the input buffer is only known once ilclient hands it out in encode_do()
+	*pbuf = NULL;
+	*plen = 0;
+
+	return -1;
+}
+
 int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 		int *polen, enum pic_t *type)
+{
+	U64 ots;
+	return encode_do_ts(handle, ibuf, ilen, 0, pobuf, polen, type, &ots);
+}
+
+int encode_do_ts(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		void **pobuf, int *polen, enum pic_t *type, U64 *pots)
 {
 	*pobuf = NULL;
 	*polen = 0;
 	*type = NONE;
+	*pots = 0;
 
+	U64 start = get_monotonic_usec();
+	handle->nnals = handle->separate_nals ? 0 : -1;
+	handle->nal_open = 0;
 	OMX_BUFFERHEADERTYPE *buf;
 	buf = ilclient_get_input_buffer(handle->video_encode, OMX_VIDENC_INPUT_PORT,
 			0);  // 0:non-block, 1:block, set to non-block to avoid freezing after long time encode
@@ -340,6 +477,7 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 	{
 		memcpy(buf->pBuffer, ibuf, ilen);
 		buf->nFilledLen = ilen;
+		buf->nTimeStamp = ilclient_ticks_from_s64(its);    // passed through to the output buffer
 
 		if (OMX_EmptyThisBuffer(ILC_GET_HANDLE(handle->video_encode), buf)
 				!= OMX_ErrorNone)
@@ -378,7 +516,9 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 	{
 		*pobuf = handle->out->pBuffer;
 		*polen = handle->out->nFilledLen;
-		*type = NONE;    // TODO: how to get the type?
+		*type = frame_type(*pobuf, *polen, flag);
+		add_nal(handle, *pobuf, *polen, 0, flag);
+		*pots = ilclient_ticks_to_s64(handle->out->nTimeStamp);
 		handle->frame_counter++;
 	}
 	else	// PPS/SPS or part frame, combination is needed
@@ -388,6 +528,7 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 		handle->combination_buffer_ptr = 0;
 		// copy the first part
 		memcpy(handle->combination_buffer + 0, handle->out->pBuffer, handle->out->nFilledLen);
+		add_nal(handle, handle->out->pBuffer, handle->out->nFilledLen, 0, flag);
 		handle->combination_buffer_ptr += handle->out->nFilledLen;
 
 		while (1)
@@ -407,6 +548,8 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 			// copy the remaining part
 			memcpy(handle->combination_buffer + handle->combination_buffer_ptr,
 					handle->out->pBuffer, handle->out->nFilledLen);
+			add_nal(handle, handle->out->pBuffer, handle->out->nFilledLen,
+					handle->combination_buffer_ptr, handle->out->nFlags);
 			handle->combination_buffer_ptr += handle->out->nFilledLen;
 
 			flag = handle->out->nFlags;	// get new flag
@@ -419,14 +562,78 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 
 		*pobuf = handle->combination_buffer;
 		*polen = handle->combination_buffer_ptr;
-		*type = NONE;    // TODO: how to get the type?
+		*type = frame_type(*pobuf, *polen, flag);
+		*pots = ilclient_ticks_to_s64(handle->out->nTimeStamp);
 		handle->frame_counter++;
 	}
 
+	if (*polen > 0)
+	{
+		handle->stats.encode_usec = get_monotonic_usec() - start;
+		handle->stats.bytes = *polen;
+		handle->stats.qp = -1;    // not reported
+		handle->stats.type = *type;
+		handle->stats.keyframe = *type == I;
+		handle->stats.timestamp = *pots;
+		handle->has_stats = 1;
+	}
+	else
+		handle->nnals = -1;
+
 	handle->out->nFilledLen = 0;    // set to 0 at end
 	return 0;
 }
 
+int encode_do_ref(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		enc_release_fn release, void *opaque, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	// the frame is copied into the encoder's own buffer, it's free right away
+	int ret = encode_do_ts(handle, ibuf, ilen, its, pobuf, polen, type, pots);
+	release(opaque, ibuf);
+
+	return ret;
+}
+
+int encode_get_packet(struct enc_handle *handle, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	// encode_do() returns every frame, nothing is left behind
+	UNUSED(handle);
+	*pobuf = NULL;
+	*polen = 0;
+	*type = NONE;
+	*pots = 0;
+
+	return 0;
+}
+
+int encode_flush(struct enc_handle *handle)
+{
+	UNUSED(handle);
+	return 0;
+}
+
+int encode_get_stats(struct enc_handle *handle, struct enc_stats *stats)
+{
+	if (!handle->has_stats)
+		return -1;
+
+	*stats = handle->stats;
+	return 0;
+}
+
+int encode_get_nals(struct enc_handle *handle, const struct enc_nal **pnals,
+		int *pnnals)
+{
+	if (handle->nnals <= 0 || handle->nal_open)    // a cut frame is scanned
+		return -1;
+
+	*pnals = handle->nals;
+	*pnnals = handle->nnals;
+	return 0;
+}
+
 int encode_get_headers(struct enc_handle *handle, void **pbuf, int *plen,
 		enum pic_t *type)
 {
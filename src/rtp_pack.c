@@ -25,9 +25,18 @@
 #include <arpa/inet.h>
 #include <sys/timeb.h>
 #include "camkit/pack.h"
+#include "startcode.h"
 
 #define H264    96
 #define MAX_OUTBUF_SIZE 10 * 1024	// 10k should be enough, normally it's less then MTU (1500)
+#define RTP_HDR_LEN 12
+#define MAX_TEMPORAL_LAYERS 3	// base, reference B and non-reference frames, see nalu_layer()
+#define FRAMEMARK_EXT_ID 1	// extmap id of the frame marking header extension
+#define FRAMEMARK_EXT_LEN 8	// RFC 8285 one-byte header extension: 0xBEDE, length, one element padded to 4 bytes
+#define STAP_A 24	// single-time aggregation packet type
+#define STAP_SIZE_LEN 2	// nalu size before every nalu of a STAP-A
+#define HDRBUF_LEN (RTP_HDR_LEN + FRAMEMARK_EXT_LEN + 2)	// headers of a packet, up to the FU header
+#define AGG_SLOTS 8	// STAP-A payloads of a pack_get_batch()
 
 typedef struct
 {
@@ -43,9 +52,9 @@ typedef struct
     // bytes 2, 3
     unsigned short seq_no;
     // bytes 4-7
-    unsigned long timestamp;
+    U32 timestamp;
     // bytes 8-11
-    unsigned long ssrc;    // sequence number
+    U32 ssrc;    // sequence number
 } rtp_header;
 
 typedef struct
@@ -98,6 +107,22 @@ struct pac_handle
     unsigned short seq_num;
     U32 ts_start_millisec;		// timestamp in millisecond
     U32 ts_current_sample;		// timestamp in 1/90000.0 unit
+    int use_frame_ts;		// 0/1, take the timestamp from pack_put_ts() instead of the clock
+    U64 frame_ts;		// timestamp of the current frame in microsecond
+    int hdr_len;		// RTP header, with the frame marking extension if any
+    int first_packet;		// 0/1, the next packet starts the buffer of pack_put()
+    int nalu_tid;		// temporal layer of the current nalu
+    unsigned char hdrbuf[HDRBUF_LEN];		// headers of the current packet
+    int hdrbuf_len;
+    startcode_fn scan;		// start code scanner of the cpu
+    const struct enc_nal *nals;		// from pack_put_nals(), NULL to scan inbuf
+    int nnals;
+    int nal_index;		// the next one of nals
+    int nalu_pending;		// 0/1, nalu is read ahead by aggregate_nalus() and not packed yet
+    char *aggbuf;		// STAP-A payloads, AGG_SLOTS of max_pkt_len bytes
+    int agg_slot;		// where the next STAP-A goes
+    unsigned char *arena;		// headers of a batch, HDRBUF_LEN per packet
+    int arena_pkts;
 
     struct pac_param params;
 };
@@ -129,11 +154,32 @@ struct pac_handle *pack_open(struct pac_param params)
     handle->ts_current_sample = 0;
     handle->params.max_pkt_len = params.max_pkt_len;
     handle->params.ssrc = params.ssrc;
+    handle->params.temporal_layers = params.temporal_layers;
+    handle->params.aggregate = params.aggregate;
+    if (handle->params.aggregate)
+    {
+        handle->aggbuf = malloc(AGG_SLOTS * handle->params.max_pkt_len);
+        if (!handle->aggbuf)
+        {
+            printf("--- Failed to malloc STAP-A buffer of size: %d\n",
+                    AGG_SLOTS * handle->params.max_pkt_len);
+            goto err1;
+        }
+    }
+    if (handle->params.temporal_layers > MAX_TEMPORAL_LAYERS)
+        handle->params.temporal_layers = MAX_TEMPORAL_LAYERS;
+    handle->hdr_len = RTP_HDR_LEN;
+    if (handle->params.temporal_layers > 1)
+        handle->hdr_len += FRAMEMARK_EXT_LEN;
     handle->ts_start_millisec = get_current_millisec();	// save the startup time
+    const char *scanner;
+    handle->scan = startcode_select(&scanner);
 
-    printf("+++ Pack Opened\n");
+    printf("+++ Pack Opened, %s start code scanner%s\n", scanner,
+            handle->params.aggregate ? ", STAP-A aggregation" : "");
     return handle;
 
+    err1:free(handle->outbuf);
     err0:free(handle);
     return NULL;
 }
@@ -141,6 +187,8 @@ struct pac_handle *pack_open(struct pac_param params)
 void pack_close(struct pac_handle *handle)
 {
 	free(handle->outbuf);
+    free(handle->aggbuf);
+    free(handle->arena);
     free(handle);
     printf("+++ Pack Closed\n");
 }
@@ -155,6 +203,26 @@ void pack_put(struct pac_handle *handle, void *inbuf, int isize)
     handle->FU_index = 0;
     handle->inbuf_complete = 0;
     handle->nalu_complete = 1;    // start a new nalu
+    handle->first_packet = 1;
+    handle->use_frame_ts = 0;
+    handle->nals = NULL;
+    handle->nalu_pending = 0;
+}
+
+void pack_put_ts(struct pac_handle *handle, void *inbuf, int isize, U64 ts)
+{
+    pack_put(handle, inbuf, isize);
+    handle->use_frame_ts = 1;
+    handle->frame_ts = ts;
+}
+
+void pack_put_nals(struct pac_handle *handle, void *inbuf, int isize, U64 ts,
+		const struct enc_nal *nals, int nnals)
+{
+    pack_put_ts(handle, inbuf, isize, ts);
+    handle->nals = nals;
+    handle->nnals = nnals;
+    handle->nal_index = 0;
 }
 
 static int is_start_code4(char *buf)
@@ -173,20 +241,122 @@ static int is_start_code3(char *buf)
         return 1;
 }
 
-static int get_next_nalu(struct pac_handle *handle)
+// exp-Golomb ue(v) at bit *pos of buf, returns -1 past end
+static int read_ue(const unsigned char *buf, int len, int *pos)
 {
-    if (!handle->next_nalu_ptr)    // reach data end, no next nalu
+    int zeros = 0;
+    while (*pos < len * 8 && !((buf[*pos / 8] >> (7 - *pos % 8)) & 1))
     {
+        zeros++;
+        (*pos)++;
+    }
+    if (*pos + zeros >= len * 8 || zeros > 16)    // no slice header field is that big
+        return -1;
+    (*pos)++;    // the 1 bit
+    U32 val = 0;
+    int i;
+    for (i = 0; i < zeros; i++, (*pos)++)
+        val = (val << 1) | ((buf[*pos / 8] >> (7 - *pos % 8)) & 1);
+    return (1U << zeros) - 1 + val;
+}
+
+/*
+ * temporal layer of the current nalu, as the encoder builds them (see enc_param.temporal_layers):
+ * the non-reference frames are the top layer, the reference B frames are the middle one,
+ * I/P frames and the parameter sets are the base layer
+ */
+static int nalu_layer(struct pac_handle *handle)
+{
+    nalu_t *nalu = &handle->nalu;
+
+    if (nalu->nal_unit_type != 1 && nalu->nal_unit_type != 5)    // not a slice
+        return 0;
+    if (nalu->nal_reference_idc == 0)
+        return handle->params.temporal_layers - 1;
+    if (handle->params.temporal_layers < 3)
         return 0;
+
+    // slice header: first_mb_in_slice, slice_type
+    int pos = 0;
+    const unsigned char *sh = (const unsigned char *) nalu->data + 1;
+    if (read_ue(sh, nalu->len - 1, &pos) < 0)
+        return 0;
+    int slice_type = read_ue(sh, nalu->len - 1, &pos);
+    return (slice_type >= 0 && slice_type % 5 == 1) ? 1 : 0;    // B slice
+}
+
+/*
+ * RTP frame marking (RFC 9626) for temporal layers, one-byte form:
+ * S: first packet of the frame, E: last packet, I: IDR, D: discardable (not a reference),
+ * B: depends on the base layer only, TID: temporal layer.
+ * The frame is the buffer of pack_put(). The SDP has to map the extension id, eg:
+ * a=extmap:1 urn:ietf:params:rtp-hdrext:framemarking
+ */
+static void put_frame_marking(struct pac_handle *handle, char *pkt, int idr,
+        int discardable, int tid)
+{
+    if (handle->params.temporal_layers <= 1)
+        return;
+
+    rtp_header *rtp_hdr = (rtp_header *) pkt;
+    rtp_hdr->extension = 1;
+
+    unsigned char *ext = (unsigned char *) pkt + RTP_HDR_LEN;
+    int last = handle->nalu_complete && !handle->next_nalu_ptr
+            && !handle->nalu_pending;
+    ext[0] = 0xBE;    // one-byte header profile
+    ext[1] = 0xDE;
+    ext[2] = 0;    // length in 32-bit words
+    ext[3] = 1;
+    ext[4] = FRAMEMARK_EXT_ID << 4;    // one data byte
+    ext[5] = (handle->first_packet << 7) | (last << 6)
+            | (idr << 5) | (discardable << 4) | ((tid == 1) << 3) | (tid & 0x7);
+    ext[6] = ext[7] = 0;    // padding
+
+    handle->first_packet = 0;
+}
+
+// take the next nalu the encoder reported
+static int get_given_nalu(struct pac_handle *handle)
+{
+    if (handle->nal_index >= handle->nnals)
+    {
+        handle->next_nalu_ptr = NULL;
+        return 0;
+    }
+
+    const struct enc_nal *nal = &handle->nals[handle->nal_index++];
+    if (nal->offset < 0 || nal->size <= 0
+            || nal->offset + nal->size > handle->inbuf_size)
+    {
+        printf("!!! Bad nalu %d: offset %d, size %d\n", handle->nal_index - 1,
+                nal->offset, nal->size);
+        return -1;
     }
 
-    if (is_start_code3(handle->next_nalu_ptr))    // check 0x000001 first
+    handle->nalu.startcodeprefix_len = 0;    // unknown, not needed
+    handle->nalu.data = (char *) handle->inbuf + nal->offset;
+    handle->nalu.len = nal->size;
+    if (handle->nal_index == handle->nnals)    // the last one
+        handle->next_nalu_ptr = NULL;
+    else
+        handle->next_nalu_ptr = (char *) handle->inbuf + nal[1].offset;
+
+    return 1;
+}
+
+// find the next nalu by its start code
+static int scan_next_nalu(struct pac_handle *handle)
+{
+    char *cur_nalu_ptr = handle->next_nalu_ptr;    // rotate, save the next ptr
+    char *end = (char *) handle->inbuf + handle->inbuf_size;
+    if (end - cur_nalu_ptr >= 3 && is_start_code3(cur_nalu_ptr))    // check 0x000001 first
     {
         handle->nalu.startcodeprefix_len = 3;
     }
     else
     {
-        if (is_start_code4(handle->next_nalu_ptr))    // check 0x00000001
+        if (end - cur_nalu_ptr >= 4 && is_start_code4(cur_nalu_ptr))    // check 0x00000001
         {
             handle->nalu.startcodeprefix_len = 4;
         }
@@ -196,34 +366,49 @@ static int get_next_nalu(struct pac_handle *handle)
             return -1;
         }
     }
-
-    // found the next start code
-    int startcode_found = 0;
-    char *cur_nalu_ptr = handle->next_nalu_ptr;    // rotate, save the next ptr
-    char *next_ptr = cur_nalu_ptr + handle->nalu.startcodeprefix_len;    // skip current start code
-    while (!startcode_found)
+    if (end - cur_nalu_ptr == handle->nalu.startcodeprefix_len)    // a start code without nalu
     {
-        next_ptr++;
-
-        if ((next_ptr - (char *) handle->inbuf) >= handle->inbuf_size)    // reach data end
-        {
-            handle->next_nalu_ptr = NULL;    // no more nalus
-            break;
-        }
-
-        if (is_start_code3(next_ptr) || is_start_code4(next_ptr))    // found the next start code
-        {
-            handle->next_nalu_ptr = next_ptr;    // next ptr
-            break;
-        }
+        handle->next_nalu_ptr = NULL;
+        return 0;
     }
 
+    // found the next start code, skip the current one and the nalu header
+    int next_prefix_len;
+    char *next_ptr = (char *) startcode_find(handle->scan,
+            cur_nalu_ptr + handle->nalu.startcodeprefix_len + 1, end, &next_prefix_len);
+    handle->next_nalu_ptr = next_ptr;    // NULL if no more nalus
+    if (!next_ptr)    // reach data end
+        next_ptr = end;
+
     handle->nalu.data = cur_nalu_ptr + handle->nalu.startcodeprefix_len;    // exclude the start code
     handle->nalu.len = next_ptr - cur_nalu_ptr
             - handle->nalu.startcodeprefix_len;
+
+    return 1;
+}
+
+static int get_next_nalu(struct pac_handle *handle)
+{
+    if (handle->nalu_pending)    // read ahead already
+    {
+        handle->nalu_pending = 0;
+        return 1;
+    }
+
+    if (!handle->next_nalu_ptr)    // reach data end, no next nalu
+    {
+        return 0;
+    }
+
+    int ret = handle->nals ? get_given_nalu(handle) : scan_next_nalu(handle);
+    if (ret <= 0)
+        return ret;
+
     handle->nalu.forbidden_bit = (handle->nalu.data[0] & 0x80) >> 7;    // 1 bit, 0b1000 0000
     handle->nalu.nal_reference_idc = (handle->nalu.data[0] & 0x60) >> 5;    // 2 bit, 0b0110 0000
     handle->nalu.nal_unit_type = (handle->nalu.data[0] & 0x1f);    // 5 bit, 0b0001 1111
+    if (handle->params.temporal_layers > 1)
+        handle->nalu_tid = nalu_layer(handle);
 
     return 1;
 }
@@ -236,15 +421,78 @@ static void dump_nalu(const nalu_t *nalu)
     printf("nal_unit_type: %x\n", nalu->nal_unit_type);
 }
 
-int pack_get(struct pac_handle *handle, void **poutbuf, int *outsize)
+static int put_stap_nalu(char *buf, const nalu_t *nalu)
 {
-    int ret;
+    unsigned char *p = (unsigned char *) buf;
+    p[0] = nalu->len >> 8;    // network order
+    p[1] = nalu->len & 0xff;
+    memcpy(p + STAP_SIZE_LEN, nalu->data, nalu->len);
+
+    return STAP_SIZE_LEN + nalu->len;
+}
+
+/*
+ * STAP-A (RFC 6184 5.7.1): the small nalus after the current one go in its packet,
+ * copied to an aggbuf slot with a size before each. The nalus of a packet share the
+ * temporal layer, the first one that doesn't fit is kept for the next packet.
+ * The payload is left as it is if no nalu joins.
+ */
+static void aggregate_nalus(struct pac_handle *handle, char **payload,
+        int *payload_len, int *idr, int *discardable)
+{
+    const int max = handle->params.max_pkt_len;
+    const int tid = handle->nalu_tid;
+    nalu_t first = handle->nalu;
+    char *stap = handle->aggbuf + handle->agg_slot * max;
+    int len = 1 + STAP_SIZE_LEN + first.len;    // STAP-A header, the first nalu
+    int count = 1;
+    int F = first.forbidden_bit, NRI = first.nal_reference_idc;
+
+    while (len + STAP_SIZE_LEN < max && get_next_nalu(handle) > 0)
+    {
+        nalu_t *nalu = &handle->nalu;
+        if (len + STAP_SIZE_LEN + nalu->len > max || handle->nalu_tid != tid)
+        {
+            handle->nalu_pending = 1;
+            break;
+        }
+
+        if (count++ == 1)    // the second nalu, start the STAP-A
+            put_stap_nalu(stap + 1, &first);
+        len += put_stap_nalu(stap + len, nalu);
+        F |= nalu->forbidden_bit;
+        if (nalu->nal_reference_idc > NRI)
+            NRI = nalu->nal_reference_idc;
+        *idr |= nalu->nal_unit_type == 5;
+        *discardable &= nalu->nal_reference_idc == 0;
+    }
+
+    if (count == 1)    // alone
+        return;
+
+    nalu_header *stap_hdr = (nalu_header *) stap;
+    stap_hdr->F = F;
+    stap_hdr->NRI = NRI;
+    stap_hdr->TYPE = STAP_A;
+    *payload = stap;
+    *payload_len = len;
+}
+
+/*
+ * build the next packet: the headers in hdrbuf (HDRBUF_LEN), their size in handle->hdrbuf_len,
+ * the payload stays in the input buffer (or aggbuf), returns 1 if got one, 0 if no more
+ */
+static int next_packet(struct pac_handle *handle, unsigned char *hdrbuf,
+        char **payload, int *payload_len)
+{
+    int ret, idr, discardable, tid;
 
     if (handle->inbuf_complete) return 0;
 
-    // clear output buffer first
-    memset(handle->outbuf, 0, MAX_OUTBUF_SIZE);    // !!! this is important, missing this may cause werid problems, like VLC displays nothing when the buf is small!
-    char *tmp_outbuf = (char *) handle->outbuf;
+    // clear the headers first, !!! missing this may cause werid problems, like VLC displays nothing
+    char *tmp_outbuf = (char *) hdrbuf;
+    int hdr = handle->hdr_len;    // payload offset
+    memset(tmp_outbuf, 0, hdr + 2);
     // set common rtp header
     rtp_header *rtp_hdr;
     rtp_hdr = (rtp_header *) tmp_outbuf;
@@ -263,33 +511,27 @@ int pack_get(struct pac_handle *handle, void **poutbuf, int *outsize)
         }
 
 //		dump_nalu(&handle->nalu);
+        idr = handle->nalu.nal_unit_type == 5;
+        discardable = handle->nalu.nal_reference_idc == 0;
+        tid = handle->nalu_tid;
 
         rtp_hdr->seq_no = htons(handle->seq_num++);    // increase for every RTP packet
-        handle->ts_current_sample = (U32) ((get_current_millisec() - handle->ts_start_millisec) * 90.0);    // calculate the timestamp for a new NALU
+        if (handle->use_frame_ts)    // all the NALUs of a frame share its capture time, 90kHz clock
+            handle->ts_current_sample = (U32) (handle->frame_ts * 9 / 100);
+        else
+            handle->ts_current_sample = (U32) ((get_current_millisec() - handle->ts_start_millisec) * 90.0);    // calculate the timestamp for a new NALU
         rtp_hdr->timestamp = htonl(handle->ts_current_sample);
         // handle the new NALU
         if (handle->nalu.len <= handle->params.max_pkt_len)    // no need to fragment
         {
             rtp_hdr->marker = 1;
-            nalu_header *nalu_hdr;
-            nalu_hdr = (nalu_header *) (tmp_outbuf + 12);
-            nalu_hdr->F = handle->nalu.forbidden_bit;
-            nalu_hdr->NRI = handle->nalu.nal_reference_idc;
-            nalu_hdr->TYPE = handle->nalu.nal_unit_type;
-            char *nalu_payload = tmp_outbuf + 13;    // 12 Bytes RTP header + 1 Byte NALU header
-            *outsize = handle->nalu.len + 12;
-            if (MAX_OUTBUF_SIZE < *outsize)    // check size
-            {
-                printf("--- RTP max output buffer size %d < pack size %d\n", MAX_OUTBUF_SIZE,
-                        *outsize);
-                abort();
-            }
-            memcpy(nalu_payload, handle->nalu.data + 1, handle->nalu.len - 1);    // exclude the nalu header
+            handle->hdrbuf_len = hdr;
+            *payload = handle->nalu.data;    // the NALU with its header
+            *payload_len = handle->nalu.len;
+            if (handle->params.aggregate)
+                aggregate_nalus(handle, payload, payload_len, &idr, &discardable);
 
             handle->nalu_complete = 1;
-
-            *poutbuf = handle->outbuf;
-            return 1;
         }
         else    // fragment needed
         {
@@ -311,104 +553,151 @@ int pack_get(struct pac_handle *handle, void **poutbuf, int *outsize)
 
             // it's the first FU
             rtp_hdr->marker = 0;
-            fu_indicator *fu_ind = (fu_indicator *) (tmp_outbuf + 12);
+            fu_indicator *fu_ind = (fu_indicator *) (tmp_outbuf + hdr);
             fu_ind->F = handle->nalu.forbidden_bit;
             fu_ind->NRI = handle->nalu.nal_reference_idc;
             fu_ind->TYPE = 28;    // FU_A
 
-            fu_header *fu_hdr = (fu_header *) (tmp_outbuf + 13);
+            fu_header *fu_hdr = (fu_header *) (tmp_outbuf + hdr + 1);
             fu_hdr->E = 0;
             fu_hdr->R = 0;
             fu_hdr->S = 1;    // start bit
             fu_hdr->TYPE = handle->nalu.nal_unit_type;
-            char *nalu_payload = tmp_outbuf + 14;
-            *outsize = handle->params.max_pkt_len + 14;    // RTP header + FU indicator + FU header
-            if (MAX_OUTBUF_SIZE < *outsize)
-            {
-                printf("--- RTP max output buffer size %d < pack size %d\n", MAX_OUTBUF_SIZE,
-                        *outsize);
-                abort();
-            }
-            memcpy(nalu_payload, handle->nalu.data + 1,
-                    handle->params.max_pkt_len);
+            handle->hdrbuf_len = hdr + 2;    // RTP header + FU indicator + FU header
+            *payload = handle->nalu.data + 1;    // exclude the nalu header
+            *payload_len = handle->params.max_pkt_len;
 
             handle->nalu_complete = 0;    // not complete
             handle->FU_index++;
-
-            *poutbuf = handle->outbuf;
-            return 1;
         }
     }
     else    // send remaining FUs
     {
+        idr = handle->nalu.nal_unit_type == 5;
+        discardable = handle->nalu.nal_reference_idc == 0;
+        tid = handle->nalu_tid;
         rtp_hdr->seq_no = htons(handle->seq_num++);
         rtp_hdr->timestamp = htonl(handle->ts_current_sample);    // it's a continuation to the last NALU, no need to recalculate
 
+        fu_indicator *fu_ind = (fu_indicator *) (tmp_outbuf + hdr);
+        fu_ind->F = handle->nalu.forbidden_bit;
+        fu_ind->NRI = handle->nalu.nal_reference_idc;
+        fu_ind->TYPE = 28;
+
+        fu_header *fu_hdr = (fu_header *) (tmp_outbuf + hdr + 1);
+        fu_hdr->R = 0;
+        fu_hdr->S = 0;
+        fu_hdr->TYPE = handle->nalu.nal_unit_type;
+        handle->hdrbuf_len = hdr + 2;
+        *payload = handle->nalu.data + 1
+                + handle->FU_index * handle->params.max_pkt_len;
+
         // check if it's the last FU
         if (handle->FU_index == handle->FU_counter)    // the last FU
         {
             rtp_hdr->marker = 1;    // the last FU
-            fu_indicator *fu_ind = (fu_indicator *) (tmp_outbuf + 12);
-            fu_ind->F = handle->nalu.forbidden_bit;
-            fu_ind->NRI = handle->nalu.nal_reference_idc;
-            fu_ind->TYPE = 28;
-
-            fu_header *fu_hdr = (fu_header *) (tmp_outbuf + 13);
-            fu_hdr->R = 0;
-            fu_hdr->S = 0;
-            fu_hdr->TYPE = handle->nalu.nal_unit_type;
             fu_hdr->E = 1;    // the last EU
-            char *nalu_payload = tmp_outbuf + 14;
-            *outsize = handle->last_FU_size - 1 + 14;
-            if (MAX_OUTBUF_SIZE < *outsize)
-            {
-                printf("--- RTP max output buffer size %d < pack size %d\n", MAX_OUTBUF_SIZE,
-                        *outsize);
-                abort();
-            }
-            memcpy(nalu_payload,
-                    handle->nalu.data + 1
-                            + handle->FU_index * handle->params.max_pkt_len,
-                    handle->last_FU_size - 1);    // minus the nalu header
+            *payload_len = handle->last_FU_size - 1;    // minus the nalu header
 
             handle->nalu_complete = 1;    // this nalu is complete
             handle->FU_index = 0;
-
-            *poutbuf = handle->outbuf;
-            return 1;
         }
         else    // middle FUs
         {
             rtp_hdr->marker = 0;
-            fu_indicator *fu_ind = (fu_indicator *) (tmp_outbuf + 12);
-            fu_ind->F = handle->nalu.forbidden_bit;
-            fu_ind->NRI = handle->nalu.nal_reference_idc;
-            fu_ind->TYPE = 28;
-
-            fu_header *fu_hdr = (fu_header *) (tmp_outbuf + 13);
-            fu_hdr->R = 0;
-            fu_hdr->S = 0;
-            fu_hdr->TYPE = handle->nalu.nal_unit_type;
             fu_hdr->E = 0;
-
-            char *nalu_payload = tmp_outbuf + 14;
-            *outsize = handle->params.max_pkt_len + 14;
-            if (MAX_OUTBUF_SIZE < *outsize)
-            {
-                printf("--- RTP max output buffer size %d < pack size %d\n", MAX_OUTBUF_SIZE,
-                        *outsize);
-                abort();
-            }
-            memcpy(nalu_payload,
-                    handle->nalu.data + 1
-                            + handle->FU_index * handle->params.max_pkt_len,
-                    handle->params.max_pkt_len);
+            *payload_len = handle->params.max_pkt_len;
 
             handle->FU_index++;
-
-            *poutbuf = handle->outbuf;
-            return 1;
         }
     }
+
+    put_frame_marking(handle, tmp_outbuf, idr, discardable, tid);
+    return 1;
+}
+
+int pack_get(struct pac_handle *handle, void **poutbuf, int *outsize)
+{
+    char *payload;
+    int payload_len;
+
+    handle->agg_slot = 0;
+    if (next_packet(handle, handle->hdrbuf, &payload, &payload_len) <= 0)
+        return 0;
+
+    *outsize = handle->hdrbuf_len + payload_len;
+    if (MAX_OUTBUF_SIZE < *outsize)    // check size
+    {
+        printf("--- RTP max output buffer size %d < pack size %d\n", MAX_OUTBUF_SIZE,
+                *outsize);
+        abort();
+    }
+    memcpy(handle->outbuf, handle->hdrbuf, handle->hdrbuf_len);
+    memcpy((char *) handle->outbuf + handle->hdrbuf_len, payload, payload_len);
+
+    *poutbuf = handle->outbuf;
+    return 1;
+}
+
+int pack_get_iov(struct pac_handle *handle, struct iovec *iov, int *iovcnt)
+{
+    char *payload;
+    int payload_len;
+
+    handle->agg_slot = 0;
+    if (next_packet(handle, handle->hdrbuf, &payload, &payload_len) <= 0)
+    {
+        *iovcnt = 0;
+        return 0;
+    }
+
+    iov[0].iov_base = handle->hdrbuf;
+    iov[0].iov_len = handle->hdrbuf_len;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = payload_len;
+    *iovcnt = 2;
+
+    return 1;
 }
 
+int pack_get_batch(struct pac_handle *handle, struct pac_pkt *pkts, int max)
+{
+    char *payload;
+    int payload_len, n;
+
+    if (max <= 0)
+        return 0;
+    if (max > handle->arena_pkts)    // grows once to the largest batch
+    {
+        unsigned char *arena = realloc(handle->arena, max * HDRBUF_LEN);
+        if (!arena)
+        {
+            printf("--- Failed to malloc RTP header arena of %d packets\n", max);
+            return 0;
+        }
+        handle->arena = arena;
+        handle->arena_pkts = max;
+    }
+
+    handle->agg_slot = 0;
+    for (n = 0; n < max; n++)
+    {
+        unsigned char *hdrbuf = handle->arena + n * HDRBUF_LEN;
+        if (handle->agg_slot == AGG_SLOTS    // no room for another STAP-A
+                || next_packet(handle, hdrbuf, &payload, &payload_len) <= 0)
+            break;
+
+        if (handle->params.aggregate && payload
+                == handle->aggbuf + handle->agg_slot * handle->params.max_pkt_len)
+            handle->agg_slot++;    // keep it for the batch
+
+        pkts[n].iov[0].iov_base = hdrbuf;
+        pkts[n].iov[0].iov_len = handle->hdrbuf_len;
+        pkts[n].iov[1].iov_base = payload;
+        pkts[n].iov[1].iov_len = payload_len;
+        pkts[n].iovcnt = 2;
+        pkts[n].len = handle->hdrbuf_len + payload_len;
+    }
+
+    return n;
+}
@@ -58,6 +58,9 @@ int main(int argc, char *argv[])
 	capp.height = HEIGHT;
 	capp.pixfmt = vfmt;
 	capp.rate = FRAMERATE;
+	capp.nbuffers = 4;
+	capp.export_dmabuf = 0;
+	capp.source = CAP_V4L;
 
 	cvtp.inwidth = WIDTH;
 	cvtp.inheight = HEIGHT;
@@ -65,6 +68,8 @@ int main(int argc, char *argv[])
 	cvtp.outwidth = WIDTH;
 	cvtp.outheight = HEIGHT;
 	cvtp.outpixfmt = ofmt;
+	cvtp.nthreads = 1;
+	cvtp.motion = 0;
 
 	encp.src_picwidth = WIDTH;
 	encp.src_picheight = HEIGHT;
@@ -74,9 +79,17 @@ int main(int argc, char *argv[])
 	encp.fps = FRAMERATE;
 	encp.gop = 30;
 	encp.bitrate = 800;
+	encp.max_b_frames = 0;
+	encp.intra_refresh = 0;
+	encp.thread_type = ENC_SLICE_THREADS;
+	encp.threads = 0;
+	encp.temporal_layers = 0;
 
 	pacp.max_pkt_len = 1400;
 	pacp.ssrc = 10;
+	pacp.temporal_layers = 0;
+	pacp.aggregate = 0;
+	encp.max_slice_size = pacp.max_pkt_len;
 
     netp.type = UDP;
     netp.serip = argv[1];
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "camkit/comdef.h"
+#include "slice_pool.h"
+
+struct worker_t
+{
+	pthread_t thread;
+	struct slice_pool *pool;
+	int index;
+};
+
+struct slice_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;	// a new job or quit
+	pthread_cond_t done_cond;	// all the slices of the job finished
+	struct worker_t *workers;
+	int nthreads;
+	int nworkers;		// started worker threads, nthreads - 1 at most
+	slice_fn fn;
+	void *arg;
+	unsigned long job_id;		// increased for every job
+	int pending;		// slices of the job not finished yet
+	int quit;
+};
+
+static void *worker_loop(void *arg)
+{
+	struct worker_t *worker = arg;
+	struct slice_pool *pool = worker->pool;
+	unsigned long last_job = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (!pool->quit && pool->job_id == last_job)
+			pthread_cond_wait(&pool->job_cond, &pool->lock);
+		if (pool->quit)
+			break;
+
+		last_job = pool->job_id;
+		slice_fn fn = pool->fn;
+		void *fnarg = pool->arg;
+		pthread_mutex_unlock(&pool->lock);
+
+		fn(fnarg, worker->index, pool->nthreads);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct slice_pool *slice_pool_open(int nthreads)
+{
+	int i;
+	struct slice_pool *pool = malloc(sizeof(struct slice_pool));
+	if (!pool)
+	{
+		printf("--- malloc slice pool failed\n");
+		return NULL;
+	}
+
+	CLEAR(*pool);
+	pool->nthreads = nthreads > 1 ? nthreads : 1;
+	pool->nworkers = 0;
+	pool->job_id = 0;
+	pool->quit = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	if (pool->nthreads > 1)
+	{
+		pool->workers = calloc(pool->nthreads - 1, sizeof(struct worker_t));
+		if (!pool->workers)
+		{
+			printf("--- calloc slice workers failed\n");
+			goto err;
+		}
+	}
+
+	// slice 0 is run by the caller
+	for (i = 1; i < pool->nthreads; i++)
+	{
+		struct worker_t *worker = &pool->workers[i - 1];
+		worker->pool = pool;
+		worker->index = i;
+		if (pthread_create(&worker->thread, NULL, worker_loop, worker) != 0)
+		{
+			printf("--- create slice worker %d failed\n", i);
+			goto err;
+		}
+		pool->nworkers++;
+	}
+
+	return pool;
+
+	err: slice_pool_close(pool);
+	return NULL;
+}
+
+void slice_pool_close(struct slice_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+void slice_pool_run(struct slice_pool *pool, slice_fn fn, void *arg)
+{
+	if (pool->nworkers == 0)
+	{
+		fn(arg, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->pending = pool->nworkers;
+	pool->job_id++;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	fn(arg, 0, pool->nthreads);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int slice_pool_count(struct slice_pool *pool)
+{
+	return pool->nworkers + 1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SLICE_POOL_H
+#define SLICE_POOL_H
+
+/**
+ * slice job, called once for every slice index in [0, count)
+ */
+typedef void (*slice_fn)(void *arg, int index, int count);
+
+/**< persistent worker threads to run a job split into slices */
+struct slice_pool;
+
+/**
+ * @brief Start the worker threads
+ * @param nthreads the number of slices of every job, the caller thread runs one of them
+ * @return the pool handle, NULL if error
+ */
+struct slice_pool *slice_pool_open(int nthreads);
+
+/**
+ * @brief Stop and join the worker threads
+ * @param pool the pool handle
+ */
+void slice_pool_close(struct slice_pool *pool);
+
+/**
+ * @brief Run a job on all the slices and wait for them to finish
+ * @param pool the pool handle
+ * @param fn the slice job
+ * @param arg the job argument
+ */
+void slice_pool_run(struct slice_pool *pool, slice_fn fn, void *arg);
+
+/**
+ * @brief Get the number of slices of a job
+ * @param pool the pool handle
+ */
+int slice_pool_count(struct slice_pool *pool);
+
+#endif
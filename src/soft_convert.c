@@ -12,71 +12,971 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <linux/videodev2.h>
 #include "camkit/convert.h"
+#include "slice_pool.h"
+#include "motion.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/**
+ * convert two YUYV lines to two Y lines and one U and V line,
+ * the chroma of the two lines is averaged (rounded down)
+ */
+typedef void (*convert_rows_fn)(const uint8_t *src1, const uint8_t *src2,
+		uint8_t *y1, uint8_t *y2, uint8_t *u, uint8_t *v, int width);
+
+/**
+ * convert and downscale four YUYV lines to two Y lines and one U and V
+ * line, every output pixel is the rounded average of a 2x2 block
+ */
+typedef void (*box2_rows_fn)(const uint8_t *src1, const uint8_t *src2,
+		const uint8_t *src3, const uint8_t *src4, uint8_t *y1, uint8_t *y2,
+		uint8_t *u, uint8_t *v, int owidth);
+
+/**
+ * convert and downscale eight YUYV lines to two Y lines and one U and V
+ * line, every output pixel is the rounded average of a 4x4 block
+ */
+typedef void (*box4_rows_fn)(const uint8_t *src, int stride, uint8_t *y1,
+		uint8_t *y2, uint8_t *u, uint8_t *v, int owidth);
+
+enum scale_t
+{
+	SCALE_NONE = 0, SCALE_BOX2, SCALE_BOX4, SCALE_BILINEAR
+};
+
+// bilinear source position of an output sample
+struct tap_t
+{
+	int pos;		// left/top source sample
+	int frac;		// weight of the next sample, 0~256
+};
+
+/**
+ * blend two lines, weight 256 - frac of the first and frac of the second,
+ * to 16 bits samples
+ */
+typedef void (*bilinear_rows_fn)(const uint8_t *top, const uint8_t *bot,
+		int frac, uint16_t *dst, int len);
+
+/**
+ * interpolate the blended samples at the taps, the sample after one is
+ * step samples further
+ */
+typedef void (*bilinear_cols_fn)(const uint16_t *src, const struct tap_t *taps,
+		int step, uint8_t *dst, int n);
 
 struct cvt_handle
 {
 	int src_buffersize;
 	uint8_t *dst_buffer;
 	int dst_buffersize;
+	enum scale_t scale;
+	convert_rows_fn convert_rows;
+	box2_rows_fn box2_rows;
+	box4_rows_fn box4_rows;
+	bilinear_rows_fn bilinear_rows;
+	bilinear_cols_fn bilinear_cols;
+	struct tap_t *xtab;		// luma columns
+	struct tap_t *xctab;		// chroma columns, in macro pixels
+	struct tap_t *ytab;		// luma lines
+	struct tap_t *yctab;		// chroma lines
+	struct slice_pool *pool;
+	const struct cvt_planes *slice_in;		// the frame converted by the slices
+	const struct cvt_planes *slice_out;
+	struct motion_meter *motion;		// NULL if not measured
 	struct cvt_param params;
 };
 
-static void yuv422_to_yuv420(uint8_t *inbuf, uint8_t *outbuf, int width,
-		int height)
+static void convert_rows_c(const uint8_t *src1, const uint8_t *src2,
+		uint8_t *y1, uint8_t *y2, uint8_t *u, uint8_t *v, int width)
+{
+	int k;
+
+	/* Scan two lines at a time, one macro pixel (2 pixels) per step */
+	for (k = 0; k < width / 2; k++)
+	{
+		y1[0] = src1[0];
+		y1[1] = src1[2];
+		y2[0] = src2[0];
+		y2[1] = src2[2];
+
+		u[k] = (src1[1] + src2[1]) / 2;
+		v[k] = (src1[3] + src2[3]) / 2;
+
+		src1 += 4;
+		src2 += 4;
+		y1 += 2;
+		y2 += 2;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+// (a + b) >> 1 without the rounding of pavgb, to be bit exact with the C version
+#define AVG_FLOOR_SSE2(a, b) _mm_sub_epi8(_mm_avg_epu8(a, b), \
+		_mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)))
+#define AVG_FLOOR_AVX2(a, b) _mm256_sub_epi8(_mm256_avg_epu8(a, b), \
+		_mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)))
+
+__attribute__((target("sse2")))
+static void convert_rows_sse2(const uint8_t *src1, const uint8_t *src2,
+		uint8_t *y1, uint8_t *y2, uint8_t *u, uint8_t *v, int width)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	int x;
+
+	// 16 pixels a step
+	for (x = 0; x + 16 <= width; x += 16)
+	{
+		__m128i a0 = _mm_loadu_si128((const __m128i *) (src1 + x * 2));
+		__m128i a1 = _mm_loadu_si128((const __m128i *) (src1 + x * 2 + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i *) (src2 + x * 2));
+		__m128i b1 = _mm_loadu_si128((const __m128i *) (src2 + x * 2 + 16));
+
+		_mm_storeu_si128((__m128i *) (y1 + x),
+				_mm_packus_epi16(_mm_and_si128(a0, lo), _mm_and_si128(a1, lo)));
+		_mm_storeu_si128((__m128i *) (y2 + x),
+				_mm_packus_epi16(_mm_and_si128(b0, lo), _mm_and_si128(b1, lo)));
+
+		__m128i uva = _mm_packus_epi16(_mm_srli_epi16(a0, 8),
+				_mm_srli_epi16(a1, 8));
+		__m128i uvb = _mm_packus_epi16(_mm_srli_epi16(b0, 8),
+				_mm_srli_epi16(b1, 8));
+		__m128i uv = AVG_FLOOR_SSE2(uva, uvb);    // U V U V ...
+
+		__m128i uu = _mm_packus_epi16(_mm_and_si128(uv, lo), _mm_setzero_si128());
+		__m128i vv = _mm_packus_epi16(_mm_srli_epi16(uv, 8), _mm_setzero_si128());
+		_mm_storel_epi64((__m128i *) (u + x / 2), uu);
+		_mm_storel_epi64((__m128i *) (v + x / 2), vv);
+	}
+
+	convert_rows_c(src1 + x * 2, src2 + x * 2, y1 + x, y2 + x, u + x / 2,
+			v + x / 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static void convert_rows_avx2(const uint8_t *src1, const uint8_t *src2,
+		uint8_t *y1, uint8_t *y2, uint8_t *u, uint8_t *v, int width)
+{
+	const __m256i lo = _mm256_set1_epi16(0x00ff);
+	int x;
+
+	// 32 pixels a step, the packs work in 128 bits lanes, reorder the qwords after them
+	for (x = 0; x + 32 <= width; x += 32)
+	{
+		__m256i a0 = _mm256_loadu_si256((const __m256i *) (src1 + x * 2));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *) (src1 + x * 2 + 32));
+		__m256i b0 = _mm256_loadu_si256((const __m256i *) (src2 + x * 2));
+		__m256i b1 = _mm256_loadu_si256((const __m256i *) (src2 + x * 2 + 32));
+
+		__m256i ya = _mm256_packus_epi16(_mm256_and_si256(a0, lo),
+				_mm256_and_si256(a1, lo));
+		__m256i yb = _mm256_packus_epi16(_mm256_and_si256(b0, lo),
+				_mm256_and_si256(b1, lo));
+		_mm256_storeu_si256((__m256i *) (y1 + x),
+				_mm256_permute4x64_epi64(ya, 0xd8));
+		_mm256_storeu_si256((__m256i *) (y2 + x),
+				_mm256_permute4x64_epi64(yb, 0xd8));
+
+		// the chroma order doesn't matter till the final split
+		__m256i uva = _mm256_packus_epi16(_mm256_srli_epi16(a0, 8),
+				_mm256_srli_epi16(a1, 8));
+		__m256i uvb = _mm256_packus_epi16(_mm256_srli_epi16(b0, 8),
+				_mm256_srli_epi16(b1, 8));
+		__m256i uv = _mm256_permute4x64_epi64(AVG_FLOOR_AVX2(uva, uvb), 0xd8);
+
+		__m256i uuvv = _mm256_packus_epi16(_mm256_and_si256(uv, lo),
+				_mm256_srli_epi16(uv, 8));
+		uuvv = _mm256_permute4x64_epi64(uuvv, 0xd8);    // 16 U then 16 V
+		_mm_storeu_si128((__m128i *) (u + x / 2), _mm256_castsi256_si128(uuvv));
+		_mm_storeu_si128((__m128i *) (v + x / 2),
+				_mm256_extracti128_si256(uuvv, 1));
+	}
+
+	convert_rows_sse2(src1 + x * 2, src2 + x * 2, y1 + x, y2 + x, u + x / 2,
+			v + x / 2, width - x);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void convert_rows_neon(const uint8_t *src1, const uint8_t *src2,
+		uint8_t *y1, uint8_t *y2, uint8_t *u, uint8_t *v, int width)
+{
+	int x;
+
+	// 32 pixels a step, vld4 splits the macro pixels into Y0, U, Y1, V
+	for (x = 0; x + 32 <= width; x += 32)
+	{
+		uint8x16x4_t a = vld4q_u8(src1 + x * 2);
+		uint8x16x4_t b = vld4q_u8(src2 + x * 2);
+		uint8x16x2_t ya, yb;
+
+		ya.val[0] = a.val[0];
+		ya.val[1] = a.val[2];
+		yb.val[0] = b.val[0];
+		yb.val[1] = b.val[2];
+		vst2q_u8(y1 + x, ya);
+		vst2q_u8(y2 + x, yb);
+
+		vst1q_u8(u + x / 2, vhaddq_u8(a.val[1], b.val[1]));
+		vst1q_u8(v + x / 2, vhaddq_u8(a.val[3], b.val[3]));
+	}
+
+	convert_rows_c(src1 + x * 2, src2 + x * 2, y1 + x, y2 + x, u + x / 2,
+			v + x / 2, width - x);
+}
+#endif
+
+static convert_rows_fn select_convert_rows(const char **name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		*name = "avx2";
+		return convert_rows_avx2;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		*name = "sse2";
+		return convert_rows_sse2;
+	}
+#endif
+
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	*name = "neon";    // mandatory on armv8
+	return convert_rows_neon;
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+	{
+		*name = "neon";
+		return convert_rows_neon;
+	}
+#endif
+#endif
+
+	*name = "c";
+	return convert_rows_c;
+}
+
+static void box2_rows_c(const uint8_t *src1, const uint8_t *src2,
+		const uint8_t *src3, const uint8_t *src4, uint8_t *y1, uint8_t *y2,
+		uint8_t *u, uint8_t *v, int owidth)
 {
-	int i = 0, j = 0, k = 0;
-	int UOffset = width * height;
-	int VOffset = (width * height) * 5 / 4;
-	int UVSize = (width * height) / 4;
-	int line1 = 0, line2 = 0;
-	int m = 0, n = 0;
-	int y = 0, u = 0, v = 0;
+	int k;
 
-	u = UOffset;
-	v = VOffset;
+	// 2 macro pixels (4 input pixels) to 2 output pixels a step
+	for (k = 0; k < owidth / 2; k++)
+	{
+		y1[0] = (src1[0] + src1[2] + src2[0] + src2[2] + 2) >> 2;
+		y1[1] = (src1[4] + src1[6] + src2[4] + src2[6] + 2) >> 2;
+		y2[0] = (src3[0] + src3[2] + src4[0] + src4[2] + 2) >> 2;
+		y2[1] = (src3[4] + src3[6] + src4[4] + src4[6] + 2) >> 2;
+
+		u[k] = (src1[1] + src1[5] + src2[1] + src2[5] + src3[1] + src3[5]
+				+ src4[1] + src4[5] + 4) >> 3;
+		v[k] = (src1[3] + src1[7] + src2[3] + src2[7] + src3[3] + src3[7]
+				+ src4[3] + src4[7] + 4) >> 3;
+
+		src1 += 8;
+		src2 += 8;
+		src3 += 8;
+		src4 += 8;
+		y1 += 2;
+		y2 += 2;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+// Y0 + Y1 of 8 macro pixels of two lines, 16 bits each
+__attribute__((target("sse2")))
+static inline __m128i box2_luma_sse2(const uint8_t *src1, const uint8_t *src2)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i a0 = _mm_loadu_si128((const __m128i *) src1);
+	__m128i a1 = _mm_loadu_si128((const __m128i *) (src1 + 16));
+	__m128i b0 = _mm_loadu_si128((const __m128i *) src2);
+	__m128i b1 = _mm_loadu_si128((const __m128i *) (src2 + 16));
+
+	__m128i s0 = _mm_add_epi16(_mm_and_si128(a0, lo), _mm_and_si128(b0, lo));
+	__m128i s1 = _mm_add_epi16(_mm_and_si128(a1, lo), _mm_and_si128(b1, lo));
+	return _mm_packs_epi32(_mm_madd_epi16(s0, one), _mm_madd_epi16(s1, one));
+}
+
+// U and V of 4 macro pixels of four lines, pairs of macro pixels summed, 16 bits each
+__attribute__((target("sse2")))
+static inline __m128i box2_chroma_sse2(const uint8_t *src1, const uint8_t *src2,
+		const uint8_t *src3, const uint8_t *src4)
+{
+	__m128i c = _mm_add_epi16(
+			_mm_add_epi16(
+					_mm_srli_epi16(_mm_loadu_si128((const __m128i *) src1), 8),
+					_mm_srli_epi16(_mm_loadu_si128((const __m128i *) src2), 8)),
+			_mm_add_epi16(
+					_mm_srli_epi16(_mm_loadu_si128((const __m128i *) src3), 8),
+					_mm_srli_epi16(_mm_loadu_si128((const __m128i *) src4), 8)));
+	c = _mm_add_epi16(c, _mm_srli_si128(c, 4));
+	return _mm_shuffle_epi32(c, _MM_SHUFFLE(3, 1, 2, 0));    // the sums in the low qword
+}
+
+__attribute__((target("sse2")))
+static void box2_rows_sse2(const uint8_t *src1, const uint8_t *src2,
+		const uint8_t *src3, const uint8_t *src4, uint8_t *y1, uint8_t *y2,
+		uint8_t *u, uint8_t *v, int owidth)
+{
+	const __m128i two = _mm_set1_epi16(2);
+	const __m128i four = _mm_set1_epi16(4);
+	const __m128i zero = _mm_setzero_si128();
+	int x, t;
+
+	// 8 output pixels (8 macro pixels of every line) a step
+	for (x = 0; x + 8 <= owidth; x += 8)
+	{
+		int o = x * 4;
+		__m128i ya = box2_luma_sse2(src1 + o, src2 + o);
+		__m128i yb = box2_luma_sse2(src3 + o, src4 + o);
+		_mm_storel_epi64((__m128i *) (y1 + x),
+				_mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(ya, two), 2), zero));
+		_mm_storel_epi64((__m128i *) (y2 + x),
+				_mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(yb, two), 2), zero));
+
+		__m128i uv = _mm_unpacklo_epi64(
+				box2_chroma_sse2(src1 + o, src2 + o, src3 + o, src4 + o),
+				box2_chroma_sse2(src1 + o + 16, src2 + o + 16, src3 + o + 16,
+						src4 + o + 16));    // U V U V U V U V
+		uv = _mm_srli_epi16(_mm_add_epi16(uv, four), 3);
+		__m128i uuvv = _mm_packs_epi32(
+				_mm_and_si128(uv, _mm_set1_epi32(0xffff)),
+				_mm_srli_epi32(uv, 16));
+		uuvv = _mm_packus_epi16(uuvv, zero);    // 4 U then 4 V
+		t = _mm_cvtsi128_si32(uuvv);
+		memcpy(u + x / 2, &t, 4);
+		t = _mm_cvtsi128_si32(_mm_srli_si128(uuvv, 4));
+		memcpy(v + x / 2, &t, 4);
+	}
+
+	box2_rows_c(src1 + x * 4, src2 + x * 4, src3 + x * 4, src4 + x * 4, y1 + x,
+			y2 + x, u + x / 2, v + x / 2, owidth - x);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void box2_rows_neon(const uint8_t *src1, const uint8_t *src2,
+		const uint8_t *src3, const uint8_t *src4, uint8_t *y1, uint8_t *y2,
+		uint8_t *u, uint8_t *v, int owidth)
+{
+	int x;
+
+	// 16 output pixels (16 macro pixels of every line) a step
+	for (x = 0; x + 16 <= owidth; x += 16)
+	{
+		uint8x16x4_t a = vld4q_u8(src1 + x * 4);
+		uint8x16x4_t b = vld4q_u8(src2 + x * 4);
+		uint8x16x4_t c = vld4q_u8(src3 + x * 4);
+		uint8x16x4_t d = vld4q_u8(src4 + x * 4);
+		uint16x8_t lo, hi;
+
+		lo = vaddq_u16(vaddl_u8(vget_low_u8(a.val[0]), vget_low_u8(a.val[2])),
+				vaddl_u8(vget_low_u8(b.val[0]), vget_low_u8(b.val[2])));
+		hi = vaddq_u16(vaddl_u8(vget_high_u8(a.val[0]), vget_high_u8(a.val[2])),
+				vaddl_u8(vget_high_u8(b.val[0]), vget_high_u8(b.val[2])));
+		vst1q_u8(y1 + x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+
+		lo = vaddq_u16(vaddl_u8(vget_low_u8(c.val[0]), vget_low_u8(c.val[2])),
+				vaddl_u8(vget_low_u8(d.val[0]), vget_low_u8(d.val[2])));
+		hi = vaddq_u16(vaddl_u8(vget_high_u8(c.val[0]), vget_high_u8(c.val[2])),
+				vaddl_u8(vget_high_u8(d.val[0]), vget_high_u8(d.val[2])));
+		vst1q_u8(y2 + x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+
+		// chroma of the four lines, then pairs of macro pixels
+		lo = vaddq_u16(vaddl_u8(vget_low_u8(a.val[1]), vget_low_u8(b.val[1])),
+				vaddl_u8(vget_low_u8(c.val[1]), vget_low_u8(d.val[1])));
+		hi = vaddq_u16(vaddl_u8(vget_high_u8(a.val[1]), vget_high_u8(b.val[1])),
+				vaddl_u8(vget_high_u8(c.val[1]), vget_high_u8(d.val[1])));
+		vst1_u8(u + x / 2,
+				vrshrn_n_u16(vcombine_u16(vpadd_u16(vget_low_u16(lo), vget_high_u16(lo)),
+						vpadd_u16(vget_low_u16(hi), vget_high_u16(hi))), 3));
+
+		lo = vaddq_u16(vaddl_u8(vget_low_u8(a.val[3]), vget_low_u8(b.val[3])),
+				vaddl_u8(vget_low_u8(c.val[3]), vget_low_u8(d.val[3])));
+		hi = vaddq_u16(vaddl_u8(vget_high_u8(a.val[3]), vget_high_u8(b.val[3])),
+				vaddl_u8(vget_high_u8(c.val[3]), vget_high_u8(d.val[3])));
+		vst1_u8(v + x / 2,
+				vrshrn_n_u16(vcombine_u16(vpadd_u16(vget_low_u16(lo), vget_high_u16(lo)),
+						vpadd_u16(vget_low_u16(hi), vget_high_u16(hi))), 3));
+	}
+
+	box2_rows_c(src1 + x * 4, src2 + x * 4, src3 + x * 4, src4 + x * 4, y1 + x,
+			y2 + x, u + x / 2, v + x / 2, owidth - x);
+}
+#endif
+
+static box2_rows_fn select_box2_rows(const char **name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		*name = "sse2";
+		return box2_rows_sse2;
+	}
+#endif
+
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	*name = "neon";
+	return box2_rows_neon;
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+	{
+		*name = "neon";
+		return box2_rows_neon;
+	}
+#endif
+#endif
+
+	*name = "c";
+	return box2_rows_c;
+}
+
+// src points to 8 YUYV lines, an output pixel averages 4x4 input pixels
+static void box4_rows_c(const uint8_t *src, int stride, uint8_t *y1,
+		uint8_t *y2, uint8_t *u, uint8_t *v, int owidth)
+{
+	int x, i;
+
+	for (x = 0; x < owidth; x++)
+	{
+		const uint8_t *p = src + x * 8;
+		int sum1 = 0, sum2 = 0;
+		for (i = 0; i < 4; i++, p += stride)
+			sum1 += p[0] + p[2] + p[4] + p[6];
+		for (; i < 8; i++, p += stride)
+			sum2 += p[0] + p[2] + p[4] + p[6];
+		y1[x] = (sum1 + 8) >> 4;
+		y2[x] = (sum2 + 8) >> 4;
+	}
+
+	// a chroma sample covers 4 macro pixels of the 8 lines
+	for (x = 0; x < owidth / 2; x++)
+	{
+		const uint8_t *p = src + x * 16;
+		int sumu = 0, sumv = 0;
+		for (i = 0; i < 8; i++, p += stride)
+		{
+			sumu += p[1] + p[5] + p[9] + p[13];
+			sumv += p[3] + p[7] + p[11] + p[15];
+		}
+		u[x] = (sumu + 16) >> 5;
+		v[x] = (sumv + 16) >> 5;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+// 2 output pixels of 4 lines: luma sums per output pixel pair and chroma words, 16 bits each
+__attribute__((target("sse2")))
+static inline void box4_block_sse2(const uint8_t *p, int stride, __m128i *luma,
+		__m128i *chroma)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	__m128i l = _mm_setzero_si128(), c = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i < 4; i++, p += stride)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *) p);
+		l = _mm_add_epi16(l, _mm_and_si128(a, lo));
+		c = _mm_add_epi16(c, _mm_srli_epi16(a, 8));
+	}
+	*luma = _mm_madd_epi16(l, _mm_set1_epi16(1));    // Y0 + Y1, Y2 + Y3 of both pixels
+	*chroma = c;    // U V U V U V U V
+}
+
+// the sum of the 4 dwords pairs of a and b, 16 bits each
+__attribute__((target("sse2")))
+static inline __m128i box4_luma_sse2(__m128i a, __m128i b)
+{
+	return _mm_madd_epi16(_mm_packs_epi32(a, b), _mm_set1_epi16(1));
+}
+
+__attribute__((target("sse2")))
+static void box4_rows_sse2(const uint8_t *src, int stride, uint8_t *y1,
+		uint8_t *y2, uint8_t *u, uint8_t *v, int owidth)
+{
+	const __m128i eight = _mm_set1_epi16(8);
+	const __m128i sixteen = _mm_set1_epi16(16);
+	const __m128i zero = _mm_setzero_si128();
+	int x, k, t;
+
+	// 8 output pixels (16 macro pixels of every line) a step, 4 blocks of 16 bytes
+	for (x = 0; x + 8 <= owidth; x += 8)
+	{
+		const uint8_t *p = src + x * 8;
+		__m128i la[4], lb[4], c[4];
+		for (k = 0; k < 4; k++)
+		{
+			__m128i ca, cb;
+			box4_block_sse2(p + k * 16, stride, &la[k], &ca);
+			box4_block_sse2(p + k * 16 + 4 * stride, stride, &lb[k], &cb);
+			// the 4 macro pixels of a chroma sample, U and V in the low dword
+			c[k] = _mm_add_epi16(ca, cb);
+			c[k] = _mm_add_epi16(c[k], _mm_srli_si128(c[k], 4));
+			c[k] = _mm_add_epi16(c[k], _mm_srli_si128(c[k], 8));
+		}
+
+		__m128i ya = _mm_packs_epi32(box4_luma_sse2(la[0], la[1]),
+				box4_luma_sse2(la[2], la[3]));
+		__m128i yb = _mm_packs_epi32(box4_luma_sse2(lb[0], lb[1]),
+				box4_luma_sse2(lb[2], lb[3]));
+		_mm_storel_epi64((__m128i *) (y1 + x),
+				_mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(ya, eight), 4), zero));
+		_mm_storel_epi64((__m128i *) (y2 + x),
+				_mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(yb, eight), 4), zero));
+
+		__m128i uv = _mm_unpacklo_epi64(_mm_unpacklo_epi32(c[0], c[1]),
+				_mm_unpacklo_epi32(c[2], c[3]));    // U V U V U V U V
+		uv = _mm_srli_epi16(_mm_add_epi16(uv, sixteen), 5);
+		__m128i uuvv = _mm_packs_epi32(
+				_mm_and_si128(uv, _mm_set1_epi32(0xffff)),
+				_mm_srli_epi32(uv, 16));
+		uuvv = _mm_packus_epi16(uuvv, zero);    // 4 U then 4 V
+		t = _mm_cvtsi128_si32(uuvv);
+		memcpy(u + x / 2, &t, 4);
+		t = _mm_cvtsi128_si32(_mm_srli_si128(uuvv, 4));
+		memcpy(v + x / 2, &t, 4);
+	}
+
+	box4_rows_c(src + x * 8, stride, y1 + x, y2 + x, u + x / 2, v + x / 2,
+			owidth - x);
+}
+#endif
+
+#ifdef HAVE_NEON
+// 4 output pixels from the Y0 + Y1 sums of 8 macro pixels
+static inline uint16x4_t box4_pairs_neon(uint16x8_t s)
+{
+	return vpadd_u16(vget_low_u16(s), vget_high_u16(s));
+}
+
+static void box4_rows_neon(const uint8_t *src, int stride, uint8_t *y1,
+		uint8_t *y2, uint8_t *u, uint8_t *v, int owidth)
+{
+	int x, i;
+	uint32_t t;
+
+	// 8 output pixels (16 macro pixels of every line) a step
+	for (x = 0; x + 8 <= owidth; x += 8)
+	{
+		const uint8_t *p = src + x * 8;
+		uint16x8_t ylo[2], yhi[2];
+		uint16x8_t ulo = vdupq_n_u16(0), uhi = vdupq_n_u16(0);
+		uint16x8_t vlo = vdupq_n_u16(0), vhi = vdupq_n_u16(0);
+
+		ylo[0] = ylo[1] = yhi[0] = yhi[1] = vdupq_n_u16(0);
+		for (i = 0; i < 8; i++, p += stride)
+		{
+			uint8x16x4_t a = vld4q_u8(p);
+			ylo[i / 4] = vaddq_u16(ylo[i / 4],
+					vaddl_u8(vget_low_u8(a.val[0]), vget_low_u8(a.val[2])));
+			yhi[i / 4] = vaddq_u16(yhi[i / 4],
+					vaddl_u8(vget_high_u8(a.val[0]), vget_high_u8(a.val[2])));
+			ulo = vaddw_u8(ulo, vget_low_u8(a.val[1]));
+			uhi = vaddw_u8(uhi, vget_high_u8(a.val[1]));
+			vlo = vaddw_u8(vlo, vget_low_u8(a.val[3]));
+			vhi = vaddw_u8(vhi, vget_high_u8(a.val[3]));
+		}
+
+		vst1_u8(y1 + x,
+				vrshrn_n_u16(vcombine_u16(box4_pairs_neon(ylo[0]),
+						box4_pairs_neon(yhi[0])), 4));
+		vst1_u8(y2 + x,
+				vrshrn_n_u16(vcombine_u16(box4_pairs_neon(ylo[1]),
+						box4_pairs_neon(yhi[1])), 4));
+
+		// a chroma sample is the sum of 2 pairs of macro pixels
+		uint16x4_t su = vpadd_u16(box4_pairs_neon(ulo), box4_pairs_neon(uhi));
+		uint16x4_t sv = vpadd_u16(box4_pairs_neon(vlo), box4_pairs_neon(vhi));
+		uint8x8_t uv = vrshrn_n_u16(vcombine_u16(su, sv), 5);    // 4 U then 4 V
+		t = vget_lane_u32(vreinterpret_u32_u8(uv), 0);
+		memcpy(u + x / 2, &t, 4);
+		t = vget_lane_u32(vreinterpret_u32_u8(uv), 1);
+		memcpy(v + x / 2, &t, 4);
+	}
+
+	box4_rows_c(src + x * 8, stride, y1 + x, y2 + x, u + x / 2, v + x / 2,
+			owidth - x);
+}
+#endif
+
+static box4_rows_fn select_box4_rows(const char **name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		*name = "sse2";
+		return box4_rows_sse2;
+	}
+#endif
 
-	for (i = 0, j = 1; i < height; i += 2, j += 2)
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	*name = "neon";
+	return box4_rows_neon;
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
 	{
-		/* Input Buffer Pointer Indexes */
-		line1 = i * width * 2;
-		line2 = j * width * 2;
+		*name = "neon";
+		return box4_rows_neon;
+	}
+#endif
+#endif
 
-		/* Output Buffer Pointer Indexes */
-		m = width * y;
-		y = y + 1;
-		n = width * y;
-		y = y + 1;
+	*name = "c";
+	return box4_rows_c;
+}
+
+// sample centers of out samples mapped to in samples, in 1/256
+static void init_taps(struct tap_t *taps, int out, int in)
+{
+	int i;
 
-		/* Scan two lines at a time */
-		for (k = 0; k < width * 2; k += 4)
+	for (i = 0; i < out; i++)
+	{
+		long long p = (long long) (2 * i + 1) * in * 256 / (2 * out) - 128;
+		if (p < 0)
+			p = 0;
+		taps[i].pos = p >> 8;
+		taps[i].frac = p & 0xff;
+		if (taps[i].pos >= in - 1)    // keep the next sample in the image
 		{
-			unsigned char Y1, Y2, U, V;
-			unsigned char Y3, Y4, U2, V2;
+			taps[i].pos = in - 2;
+			taps[i].frac = 256;
+		}
+	}
+}
+
+static void bilinear_rows_c(const uint8_t *top, const uint8_t *bot, int frac,
+		uint16_t *dst, int len)
+{
+	int k;
+
+	for (k = 0; k < len; k++)
+		dst[k] = top[k] * (256 - frac) + bot[k] * frac;
+}
+
+static void bilinear_cols_c(const uint16_t *src, const struct tap_t *taps,
+		int step, uint8_t *dst, int n)
+{
+	int x;
+
+	for (x = 0; x < n; x++)
+	{
+		const uint16_t *p = src + taps[x].pos * step;
+		dst[x] = (p[0] * (256 - taps[x].frac) + p[step] * taps[x].frac + 32768)
+				>> 16;
+	}
+}
+
+// the two samples and the weight of the next one of 8 output samples
+static inline void bilinear_gather(const uint16_t *src, const struct tap_t *taps,
+		int step, uint16_t *a, uint16_t *b, uint16_t *w)
+{
+	int k;
+
+	for (k = 0; k < 8; k++)
+	{
+		const uint16_t *p = src + taps[k].pos * step;
+		a[k] = p[0];
+		b[k] = p[step];
+		w[k] = taps[k].frac;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void bilinear_rows_sse2(const uint8_t *top, const uint8_t *bot, int frac,
+		uint16_t *dst, int len)
+{
+	const __m128i wt = _mm_set1_epi16(256 - frac);
+	const __m128i wb = _mm_set1_epi16(frac);
+	const __m128i zero = _mm_setzero_si128();
+	int k;
+
+	// 16 samples a step, the blend is at most 255 * 256 and fits the 16 bits products
+	for (k = 0; k + 16 <= len; k += 16)
+	{
+		__m128i t = _mm_loadu_si128((const __m128i *) (top + k));
+		__m128i b = _mm_loadu_si128((const __m128i *) (bot + k));
+		_mm_storeu_si128((__m128i *) (dst + k),
+				_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(t, zero), wt),
+						_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), wb)));
+		_mm_storeu_si128((__m128i *) (dst + k + 8),
+				_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(t, zero), wt),
+						_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), wb)));
+	}
+
+	bilinear_rows_c(top + k, bot + k, frac, dst + k, len - k);
+}
+
+// a * wa + b * wb of unsigned 16 bits words, the 32 bits products of the low or high 4 words
+#define MUL_ADD_LO_SSE2(a, wa, b, wb) _mm_add_epi32( \
+		_mm_unpacklo_epi16(_mm_mullo_epi16(a, wa), _mm_mulhi_epu16(a, wa)), \
+		_mm_unpacklo_epi16(_mm_mullo_epi16(b, wb), _mm_mulhi_epu16(b, wb)))
+#define MUL_ADD_HI_SSE2(a, wa, b, wb) _mm_add_epi32( \
+		_mm_unpackhi_epi16(_mm_mullo_epi16(a, wa), _mm_mulhi_epu16(a, wa)), \
+		_mm_unpackhi_epi16(_mm_mullo_epi16(b, wb), _mm_mulhi_epu16(b, wb)))
+
+__attribute__((target("sse2")))
+static void bilinear_cols_sse2(const uint16_t *src, const struct tap_t *taps,
+		int step, uint8_t *dst, int n)
+{
+	const __m128i half = _mm_set1_epi32(32768);
+	uint16_t a[8], b[8], w[8];
+	int x;
+
+	// 8 output samples a step
+	for (x = 0; x + 8 <= n; x += 8)
+	{
+		bilinear_gather(src, taps + x, step, a, b, w);
+		__m128i va = _mm_loadu_si128((const __m128i *) a);
+		__m128i vb = _mm_loadu_si128((const __m128i *) b);
+		__m128i wb = _mm_loadu_si128((const __m128i *) w);
+		__m128i wa = _mm_sub_epi16(_mm_set1_epi16(256), wb);
+
+		__m128i lo = _mm_srli_epi32(
+				_mm_add_epi32(MUL_ADD_LO_SSE2(va, wa, vb, wb), half), 16);
+		__m128i hi = _mm_srli_epi32(
+				_mm_add_epi32(MUL_ADD_HI_SSE2(va, wa, vb, wb), half), 16);
+		_mm_storel_epi64((__m128i *) (dst + x),
+				_mm_packus_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128()));
+	}
+
+	bilinear_cols_c(src, taps + x, step, dst + x, n - x);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void bilinear_rows_neon(const uint8_t *top, const uint8_t *bot, int frac,
+		uint16_t *dst, int len)
+{
+	int k;
+
+	// 16 samples a step, the weights may be 256 so they are 16 bits
+	for (k = 0; k + 16 <= len; k += 16)
+	{
+		uint8x16_t t = vld1q_u8(top + k);
+		uint8x16_t b = vld1q_u8(bot + k);
+		vst1q_u16(dst + k,
+				vmlaq_n_u16(vmulq_n_u16(vmovl_u8(vget_low_u8(t)), 256 - frac),
+						vmovl_u8(vget_low_u8(b)), frac));
+		vst1q_u16(dst + k + 8,
+				vmlaq_n_u16(vmulq_n_u16(vmovl_u8(vget_high_u8(t)), 256 - frac),
+						vmovl_u8(vget_high_u8(b)), frac));
+	}
+
+	bilinear_rows_c(top + k, bot + k, frac, dst + k, len - k);
+}
+
+static void bilinear_cols_neon(const uint16_t *src, const struct tap_t *taps,
+		int step, uint8_t *dst, int n)
+{
+	uint16_t a[8], b[8], w[8];
+	int x;
+
+	// 8 output samples a step
+	for (x = 0; x + 8 <= n; x += 8)
+	{
+		bilinear_gather(src, taps + x, step, a, b, w);
+		uint16x8_t va = vld1q_u16(a);
+		uint16x8_t vb = vld1q_u16(b);
+		uint16x8_t wb = vld1q_u16(w);
+		uint16x8_t wa = vsubq_u16(vdupq_n_u16(256), wb);
+
+		uint32x4_t lo = vmlal_u16(vmull_u16(vget_low_u16(va), vget_low_u16(wa)),
+				vget_low_u16(vb), vget_low_u16(wb));
+		uint32x4_t hi = vmlal_u16(vmull_u16(vget_high_u16(va), vget_high_u16(wa)),
+				vget_high_u16(vb), vget_high_u16(wb));
+		vst1_u8(dst + x,
+				vmovn_u16(vcombine_u16(vrshrn_n_u32(lo, 16), vrshrn_n_u32(hi, 16))));
+	}
+
+	bilinear_cols_c(src, taps + x, step, dst + x, n - x);
+}
+#endif
+
+static bilinear_rows_fn select_bilinear_rows(const char **name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		*name = "sse2";
+		return bilinear_rows_sse2;
+	}
+#endif
 
-			/* Read Input Buffer */
-			Y1 = inbuf[line1++];
-			U = inbuf[line1++];
-			Y2 = inbuf[line1++];
-			V = inbuf[line1++];
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	*name = "neon";
+	return bilinear_rows_neon;
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+	{
+		*name = "neon";
+		return bilinear_rows_neon;
+	}
+#endif
+#endif
 
-			Y3 = inbuf[line2++];
-			U2 = inbuf[line2++];
-			Y4 = inbuf[line2++];
-			V2 = inbuf[line2++];
+	*name = "c";
+	return bilinear_rows_c;
+}
 
-			/* Write Output Buffer */
-			outbuf[m++] = Y1;
-			outbuf[m++] = Y2;
+static bilinear_cols_fn select_bilinear_cols(const char **name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		*name = "sse2";
+		return bilinear_cols_sse2;
+	}
+#endif
 
-			outbuf[n++] = Y3;
-			outbuf[n++] = Y4;
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	*name = "neon";
+	return bilinear_cols_neon;
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+	{
+		*name = "neon";
+		return bilinear_cols_neon;
+	}
+#endif
+#endif
+
+	*name = "c";
+	return bilinear_cols_c;
+}
+
+// two luma lines and a chroma line, blended across the lines first, then across the columns
+static void bilinear_pair(struct cvt_handle *handle, const uint8_t *inbuf,
+		int stride, uint8_t *y1, uint8_t *y2, uint8_t *u, uint8_t *v, int oy)
+{
+	const int len = handle->params.inwidth * 2;
+	const int owidth = handle->params.outwidth;
+	uint16_t line[len];    // a blended YUYV line, on the stack as the slices run at once
+	const struct tap_t *ty;
+
+	ty = &handle->ytab[oy];
+	handle->bilinear_rows(inbuf + ty->pos * stride,
+			inbuf + (ty->pos + 1) * stride, ty->frac, line, len);
+	handle->bilinear_cols(line, handle->xtab, 2, y1, owidth);
+
+	ty = &handle->ytab[oy + 1];
+	handle->bilinear_rows(inbuf + ty->pos * stride,
+			inbuf + (ty->pos + 1) * stride, ty->frac, line, len);
+	handle->bilinear_cols(line, handle->xtab, 2, y2, owidth);
+
+	ty = &handle->yctab[oy / 2];
+	handle->bilinear_rows(inbuf + ty->pos * stride,
+			inbuf + (ty->pos + 1) * stride, ty->frac, line, len);
+	handle->bilinear_cols(line + 1, handle->xctab, 4, u, owidth / 2);
+	handle->bilinear_cols(line + 3, handle->xctab, 4, v, owidth / 2);
+}
 
-			outbuf[u++] = (U + U2) / 2;
-			outbuf[v++] = (V + V2) / 2;
+// convert the output lines [starty, endy), starty and endy must be even, returns the changed motion blocks
+static int yuv422_to_yuv420(struct cvt_handle *handle,
+		const struct cvt_planes *in, const struct cvt_planes *out, int starty,
+		int endy)
+{
+	int owidth = handle->params.outwidth;
+	const uint8_t *inbuf = in->data[0];
+	int stride = in->stride[0];
+	int changed = 0;
+	int i;
+
+	for (i = starty; i < endy; i += 2)
+	{
+		uint8_t *y1 = (uint8_t *) out->data[0] + i * out->stride[0];
+		uint8_t *y2 = y1 + out->stride[0];
+		uint8_t *uline = (uint8_t *) out->data[1] + (i / 2) * out->stride[1];
+		uint8_t *vline = (uint8_t *) out->data[2] + (i / 2) * out->stride[2];
+		const uint8_t *src;
+
+		switch (handle->scale)
+		{
+			case SCALE_NONE:
+				src = inbuf + i * stride;
+				handle->convert_rows(src, src + stride, y1, y2, uline, vline,
+						owidth);
+				break;
+			case SCALE_BOX2:
+				src = inbuf + i * 2 * stride;
+				handle->box2_rows(src, src + stride, src + 2 * stride,
+						src + 3 * stride, y1, y2, uline, vline, owidth);
+				break;
+			case SCALE_BOX4:
+				handle->box4_rows(inbuf + i * 4 * stride, stride, y1, y2, uline,
+						vline, owidth);
+				break;
+			default:
+				bilinear_pair(handle, inbuf, stride, y1, y2, uline, vline, i);
+				break;
 		}
+
+		// compare the luma while it's in cache
+		if (handle->motion)
+			changed += motion_line(handle->motion, y1, i);
 	}
+
+	return changed;
+}
+
+static void add_motion(struct cvt_handle *handle, int changed)
+{
+	if (handle->motion)
+		motion_add(handle->motion, changed);
+}
+
+static void begin_motion(struct cvt_handle *handle)
+{
+	if (handle->motion)
+		motion_begin(handle->motion);
+}
+
+static void end_motion(struct cvt_handle *handle)
+{
+	if (handle->motion)
+		motion_end(handle->motion);
+}
+
+static void convert_slice(void *arg, int index, int count)
+{
+	struct cvt_handle *handle = arg;
+	int pairs = handle->params.outheight / 2;
+
+	add_motion(handle,
+			yuv422_to_yuv420(handle, handle->slice_in, handle->slice_out,
+					pairs * index / count * 2, pairs * (index + 1) / count * 2));
 }
 
 struct cvt_handle *convert_open(struct cvt_param param)
@@ -95,6 +995,12 @@ struct cvt_handle *convert_open(struct cvt_param param)
 	handle->params.outwidth = param.outwidth;
 	handle->params.outheight = param.outheight;
 	handle->params.outpixfmt = param.outpixfmt;
+	handle->params.nthreads = param.nthreads;
+	handle->params.motion = param.motion;
+	if (handle->params.nthreads < 1)
+		handle->params.nthreads = 1;
+	if (handle->params.nthreads > handle->params.outheight / 2)
+		handle->params.nthreads = handle->params.outheight / 2;
 
 	if (handle->params.inpixfmt != V4L2_PIX_FMT_YUYV
 			|| handle->params.outpixfmt != V4L2_PIX_FMT_YUV420)
@@ -103,10 +1009,11 @@ struct cvt_handle *convert_open(struct cvt_param param)
 		goto err0;
 	}
 
-	if (handle->params.inwidth != handle->params.outwidth
-			|| handle->params.inheight != handle->params.outheight)
+	if ((handle->params.outwidth & 1) || (handle->params.outheight & 1)
+			|| handle->params.outwidth < 2 || handle->params.outheight < 2
+			|| handle->params.inwidth < 4 || handle->params.inheight < 2)
 	{
-		printf("--- Scaling is not supported\n");
+		printf("--- Image sizes must be even\n");
 		goto err0;
 	}
 
@@ -121,9 +1028,80 @@ struct cvt_handle *convert_open(struct cvt_param param)
 		goto err0;
 	}
 
+	const char *kernel;
+	if (handle->params.inwidth == handle->params.outwidth
+			&& handle->params.inheight == handle->params.outheight)
+	{
+		handle->scale = SCALE_NONE;
+		handle->convert_rows = select_convert_rows(&kernel);
+		printf("+++ YUYV to YUV420 kernel: %s\n", kernel);
+	}
+	else if (handle->params.inwidth == handle->params.outwidth * 2
+			&& handle->params.inheight == handle->params.outheight * 2)
+	{
+		handle->scale = SCALE_BOX2;
+		handle->box2_rows = select_box2_rows(&kernel);
+		printf("+++ YUYV to YUV420 2:1 box scale kernel: %s\n", kernel);
+	}
+	else if (handle->params.inwidth == handle->params.outwidth * 4
+			&& handle->params.inheight == handle->params.outheight * 4)
+	{
+		handle->scale = SCALE_BOX4;
+		handle->box4_rows = select_box4_rows(&kernel);
+		printf("+++ YUYV to YUV420 4:1 box scale kernel: %s\n", kernel);
+	}
+	else
+	{
+		handle->scale = SCALE_BILINEAR;
+		handle->xtab = malloc(handle->params.outwidth * sizeof(struct tap_t));
+		handle->xctab = malloc(
+				handle->params.outwidth / 2 * sizeof(struct tap_t));
+		handle->ytab = malloc(handle->params.outheight * sizeof(struct tap_t));
+		handle->yctab = malloc(
+				handle->params.outheight / 2 * sizeof(struct tap_t));
+		if (!handle->xtab || !handle->xctab || !handle->ytab || !handle->yctab)
+		{
+			printf("--- malloc scale tables failed\n");
+			goto err1;
+		}
+		init_taps(handle->xtab, handle->params.outwidth, handle->params.inwidth);
+		init_taps(handle->xctab, handle->params.outwidth / 2,
+				handle->params.inwidth / 2);
+		init_taps(handle->ytab, handle->params.outheight,
+				handle->params.inheight);
+		init_taps(handle->yctab, handle->params.outheight / 2,
+				handle->params.inheight);
+		handle->bilinear_rows = select_bilinear_rows(&kernel);
+		handle->bilinear_cols = select_bilinear_cols(&kernel);
+		printf("+++ YUYV to YUV420 bilinear scale kernel: %s\n", kernel);
+	}
+
+	if (handle->params.motion)
+	{
+		handle->motion = motion_open(handle->params.outwidth,
+				handle->params.outheight);
+		if (!handle->motion)
+			goto err1;
+	}
+
+	handle->pool = slice_pool_open(handle->params.nthreads);
+	if (!handle->pool)
+	{
+		printf("--- open convert threads failed\n");
+		goto err2;
+	}
+	printf("+++ Convert threads: %d\n", slice_pool_count(handle->pool));
+
 	printf("+++ Convert Opened\n");
 	return handle;
 
+	err2: if (handle->motion)
+		motion_close(handle->motion);
+	err1: free(handle->xtab);
+	free(handle->xctab);
+	free(handle->ytab);
+	free(handle->yctab);
+	free(handle->dst_buffer);
 	err0: free(handle);
 	return NULL;
 
@@ -131,6 +1109,13 @@ struct cvt_handle *convert_open(struct cvt_param param)
 
 void convert_close(struct cvt_handle *handle)
 {
+	slice_pool_close(handle->pool);
+	if (handle->motion)
+		motion_close(handle->motion);
+	free(handle->xtab);
+	free(handle->xctab);
+	free(handle->ytab);
+	free(handle->yctab);
 	free(handle->dst_buffer);
 	free(handle);
 	printf("+++ Convert Closed\n");
@@ -139,6 +1124,8 @@ void convert_close(struct cvt_handle *handle)
 int convert_do(struct cvt_handle *handle, const void *inbuf, int isize,
 		void **poutbuf, int *posize)
 {
+	struct cvt_planes in, out;
+
 	if (isize != handle->src_buffersize)
 	{
 		printf("--- %s:%s in buffer size != src image size\n", __FILE__,
@@ -146,8 +1133,19 @@ int convert_do(struct cvt_handle *handle, const void *inbuf, int isize,
 		abort();
 	}
 
-	yuv422_to_yuv420((uint8_t *) inbuf, handle->dst_buffer,
-			handle->params.inwidth, handle->params.inheight);
+	CLEAR(in);
+	in.data[0] = (void *) inbuf;
+	in.stride[0] = handle->params.inwidth * 2;
+
+	out.data[0] = handle->dst_buffer;
+	out.data[1] = handle->dst_buffer
+			+ handle->params.outwidth * handle->params.outheight;
+	out.data[2] = out.data[1]
+			+ handle->params.outwidth * handle->params.outheight / 4;
+	out.stride[0] = handle->params.outwidth;
+	out.stride[1] = out.stride[2] = handle->params.outwidth / 2;
+
+	convert_do_into(handle, &in, &out);
 
 	*poutbuf = handle->dst_buffer;
 	*posize = handle->dst_buffersize;
@@ -155,3 +1153,89 @@ int convert_do(struct cvt_handle *handle, const void *inbuf, int isize,
 	return 0;
 }
 
+int convert_do_into(struct cvt_handle *handle, const struct cvt_planes *in,
+		const struct cvt_planes *out)
+{
+	if (in->stride[0] < handle->params.inwidth * 2)
+	{
+		printf("--- Input stride %d is less than a line\n", in->stride[0]);
+		return -1;
+	}
+
+	handle->slice_in = in;
+	handle->slice_out = out;
+	begin_motion(handle);
+	slice_pool_run(handle->pool, convert_slice, handle);
+	end_motion(handle);
+
+	return 0;
+}
+
+// the outputs of convert_do_multi()
+struct multi_job
+{
+	struct cvt_handle **handles;
+	int n;
+	const struct cvt_planes *in;
+	const struct cvt_planes *outs;
+};
+
+static void convert_multi_slice(void *arg, int index, int count)
+{
+	struct multi_job *job = arg;
+	int i;
+
+	// the same input band for every output, read once from memory
+	for (i = 0; i < job->n; i++)
+	{
+		struct cvt_handle *handle = job->handles[i];
+		int pairs = handle->params.outheight / 2;
+
+		add_motion(handle,
+				yuv422_to_yuv420(handle, job->in, &job->outs[i],
+						pairs * index / count * 2,
+						pairs * (index + 1) / count * 2));
+	}
+}
+
+int convert_do_multi(struct cvt_handle **handles, int n,
+		const struct cvt_planes *in, const struct cvt_planes *outs)
+{
+	struct multi_job job;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (handles[i]->params.inwidth != handles[0]->params.inwidth
+				|| handles[i]->params.inheight != handles[0]->params.inheight)
+		{
+			printf("--- Simulcast outputs must have the same input\n");
+			return -1;
+		}
+	}
+	if (in->stride[0] < handles[0]->params.inwidth * 2)
+	{
+		printf("--- Input stride %d is less than a line\n", in->stride[0]);
+		return -1;
+	}
+
+	job.handles = handles;
+	job.n = n;
+	job.in = in;
+	job.outs = outs;
+	for (i = 0; i < n; i++)
+		begin_motion(handles[i]);
+	slice_pool_run(handles[0]->pool, convert_multi_slice, &job);
+	for (i = 0; i < n; i++)
+		end_motion(handles[i]);
+
+	return 0;
+}
+
+int convert_get_motion(struct cvt_handle *handle)
+{
+	if (!handle->motion)
+		return -1;
+
+	return motion_get_score(handle->motion);
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "startcode.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#define SCAN_BLOCK 32	// offsets tested for a zero pair at once by the simd scanners
+
+static const char *scan_c(const char *p, const char *end)
+{
+	// memchr jumps to the zeros, the last start code may begin at end - 3
+	while (end - p >= 3)
+	{
+		const char *z = memchr(p, 0, end - p - 2);
+		if (!z)
+			return NULL;
+		if (z[1] == 0 && z[2] == 1)
+			return z;
+		p = z + (z[1] ? 2 : 1);    // a non zero byte can't be the second one
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+// start code mask of the 16 offsets from p, needs p[0, 18)
+__attribute__((target("sse2")))
+static inline int startcode_mask_sse2(const char *p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i b0 = _mm_loadu_si128((const __m128i *) p);
+	__m128i b1 = _mm_loadu_si128((const __m128i *) (p + 1));
+	__m128i b2 = _mm_loadu_si128((const __m128i *) (p + 2));
+	__m128i m = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+			_mm_cmpeq_epi8(b2, _mm_set1_epi8(1)));
+	return _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+static const char *scan_sse2(const char *p, const char *end)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	// emulation prevention keeps zero pairs rare, only the blocks with one are checked
+	while (end - p >= SCAN_BLOCK + 2)
+	{
+		__m128i lo = _mm_or_si128(_mm_loadu_si128((const __m128i *) p),
+				_mm_loadu_si128((const __m128i *) (p + 1)));
+		__m128i hi = _mm_or_si128(_mm_loadu_si128((const __m128i *) (p + 16)),
+				_mm_loadu_si128((const __m128i *) (p + 17)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(lo, hi), zero)))
+		{
+			int mask = startcode_mask_sse2(p);
+			if (mask)
+				return p + __builtin_ctz(mask);
+			mask = startcode_mask_sse2(p + 16);
+			if (mask)
+				return p + 16 + __builtin_ctz(mask);
+		}
+		p += SCAN_BLOCK;
+	}
+
+	return scan_c(p, end);
+}
+#endif
+
+#ifdef HAVE_NEON
+static const char *scan_neon(const char *p, const char *end)
+{
+	while (end - p >= SCAN_BLOCK + 2)
+	{
+		const uint8_t *u = (const uint8_t *) p;
+		uint8x16_t lo = vorrq_u8(vld1q_u8(u), vld1q_u8(u + 1));
+		uint8x16_t hi = vorrq_u8(vld1q_u8(u + 16), vld1q_u8(u + 17));
+		uint8x16_t z = vceqq_u8(vminq_u8(lo, hi), vdupq_n_u8(0));
+		uint64x2_t z64 = vreinterpretq_u64_u8(z);
+		if (vgetq_lane_u64(z64, 0) | vgetq_lane_u64(z64, 1))
+		{
+			// no movemask on neon, the rare blocks with a zero pair are checked bytewise
+			const char *sc = scan_c(p, p + SCAN_BLOCK + 2);
+			if (sc)
+				return sc;
+		}
+		p += SCAN_BLOCK;
+	}
+
+	return scan_c(p, end);
+}
+#endif
+
+startcode_fn startcode_select(const char **name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		*name = "sse2";
+		return scan_sse2;
+	}
+#endif
+
+#ifdef HAVE_NEON
+#if defined(__aarch64__)
+	*name = "neon";    // mandatory on armv8
+	return scan_neon;
+#else
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+	{
+		*name = "neon";
+		return scan_neon;
+	}
+#endif
+#endif
+
+	*name = "c";
+	return scan_c;
+}
+
+const char *startcode_find(startcode_fn scan, const char *p, const char *end,
+		int *prefix_len)
+{
+	const char *sc = scan(p, end);
+	if (!sc)
+		return NULL;
+
+	// a zero before 0x000001 makes it the 4 bytes code
+	if (sc > p && sc[-1] == 0)
+	{
+		*prefix_len = 4;
+		return sc - 1;
+	}
+	*prefix_len = 3;
+	return sc;
+}
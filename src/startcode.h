@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef STARTCODE_H
+#define STARTCODE_H
+
+/**
+ * scan [p, end) for the 0x000001 start code, returns its first byte, NULL if none
+ */
+typedef const char *(*startcode_fn)(const char *p, const char *end);
+
+/**
+ * @brief Pick the fastest scanner of the running cpu
+ * @param name set to the name of the scanner, "c", "sse2" or "neon"
+ * @return the scanner
+ */
+startcode_fn startcode_select(const char **name);
+
+/**
+ * @brief Find the next Annex B start code
+ * @param scan the scanner from startcode_select()
+ * @param p where to start
+ * @param end the end of the buffer, nothing is read from there on
+ * @param prefix_len set to the start code length, 3 (0x000001) or 4 (0x00000001)
+ * @return the first byte of the start code, NULL if none
+ */
+const char *startcode_find(startcode_fn scan, const char *p, const char *end,
+		int *prefix_len);
+
+#endif
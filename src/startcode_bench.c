@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/*
+ * start code scanner benchmark, compares the bytewise scanner rtp_pack used to have
+ * with startcode_find() on recorded Annex B streams, eg. the -o output of cktool:
+ * #startcode_bench record.h264 ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "startcode.h"
+
+#define MIN_BENCH_USEC 500000	// run every scanner for at least that long
+#define PADDING 4	// the bytewise scanner reads up to 3 bytes past the end
+
+static double get_monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static int is_start_code4(const char *buf)
+{
+	return buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == 1;
+}
+
+static int is_start_code3(const char *buf)
+{
+	return buf[0] == 0 && buf[1] == 0 && buf[2] == 1;
+}
+
+// the former get_next_nalu() loop
+static const char *find_bytewise(const char *p, const char *end, int *prefix_len)
+{
+	for (; p < end; p++)
+	{
+		if (is_start_code3(p))
+		{
+			*prefix_len = 3;
+			return p;
+		}
+		if (is_start_code4(p))
+		{
+			*prefix_len = 4;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+// walk all the nalus like rtp_pack does, returns the number of nalus
+static int count_bytewise(const char *buf, int size, unsigned *sum)
+{
+	const char *end = buf + size;
+	const char *p = buf;
+	int n = 0, prefix_len = is_start_code3(buf) ? 3 : 4;
+
+	while ((p = find_bytewise(p + prefix_len + 1, end, &prefix_len)))
+	{
+		*sum = *sum * 31 + (p - buf) + prefix_len;
+		n++;
+	}
+
+	return n;
+}
+
+static int count_scan(startcode_fn scan, const char *buf, int size, unsigned *sum)
+{
+	const char *end = buf + size;
+	const char *p = buf;
+	int n = 0, prefix_len = is_start_code3(buf) ? 3 : 4;
+
+	while (end - p > prefix_len + 1
+			&& (p = startcode_find(scan, p + prefix_len + 1, end, &prefix_len)))
+	{
+		*sum = *sum * 31 + (p - buf) + prefix_len;
+		n++;
+	}
+
+	return n;
+}
+
+static char *load_file(const char *name, int *size)
+{
+	FILE *fp = fopen(name, "rb");
+	if (!fp)
+	{
+		printf("--- Failed to open %s\n", name);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *buf = malloc(*size + PADDING);
+	if (!buf || fread(buf, 1, *size, fp) != (size_t) *size)
+	{
+		printf("--- Failed to read %s\n", name);
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	memset(buf + *size, 0xff, PADDING);    // no start code in the padding
+	fclose(fp);
+
+	return buf;
+}
+
+static double bench(const char *label, startcode_fn scan, const char *buf, int size,
+		unsigned *sum)
+{
+	double start = get_monotonic_usec(), elapsed;
+	long long bytes = 0;
+	int nalus;
+
+	do
+	{
+		*sum = 0;
+		nalus = scan ? count_scan(scan, buf, size, sum) : count_bytewise(buf, size, sum);
+		bytes += size;
+		elapsed = get_monotonic_usec() - start;
+	} while (elapsed < MIN_BENCH_USEC);
+
+	double mbps = bytes / elapsed;    // bytes per usec is MB/s
+	printf("    %-9s %8.1f MB/s, %d nalus\n", label, mbps, nalus + 1);
+	return mbps;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		printf("Usage: #startcode_bench stream.h264 ...\n");
+		return -1;
+	}
+
+	const char *name;
+	startcode_fn scan = startcode_select(&name);
+	int i, ret = 0;
+
+	for (i = 1; i < argc; i++)
+	{
+		int size;
+		char *buf = load_file(argv[i], &size);
+		if (!buf)
+		{
+			ret = -1;
+			continue;
+		}
+
+		printf("+++ %s: %d bytes\n", argv[i], size);
+		unsigned ref_sum, sum;
+		double ref = bench("bytewise", NULL, buf, size, &ref_sum);
+		double mbps = bench(name, scan, buf, size, &sum);
+		printf("    speedup   %8.1fx\n", mbps / ref);
+		if (sum != ref_sum)
+		{
+			printf("--- %s found other start codes than bytewise\n", name);
+			ret = -1;
+		}
+
+		free(buf);
+	}
+
+	return ret;
+}
@@ -30,26 +30,35 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include "camkit/capture.h"
+#include "virtual_capture.h"
+
+#define DEFAULT_NBUFFERS 4
 
 struct buffer_t
 {
 	void *start;
 	size_t length;
+	int queued;		// 0/1, owned by the driver or by the user
+	int dmabuf_fd;		// -1 if not exported
 };
 
 struct cap_handle
 {
 	int fd;
 	int image_size;
+	int bytesperline;
 	struct buffer_t *buffers;
 	unsigned int nbuffers;
 	struct cap_param params;
 	int quit;
 	unsigned long image_counter;
-	// v4l2 buffer get/put
-	struct v4l2_buffer v4lbuf;
-	int v4lbuf_put;		// 0/1
+	unsigned int nqueued;		// buffers owned by the driver
+	// frame held by capture_get_data()
+	struct cap_frame frame;
+	int frame_put;		// 0/1
+	struct vcap_handle *vcap;		// virtual source, NULL for V4L2 devices
 };
 
 static int xioctl(int fd, int request, void *arg)
@@ -61,12 +70,30 @@ static int xioctl(int fd, int request, void *arg)
 	return r;
 }
 
+static U64 get_monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (U64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static U64 get_buffer_timestamp(const struct v4l2_buffer *buf)
+{
+	// only monotonic driver timestamps are comparable between frames
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+			== V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+			&& (buf->timestamp.tv_sec != 0 || buf->timestamp.tv_usec != 0))
+		return (U64) buf->timestamp.tv_sec * 1000000 + buf->timestamp.tv_usec;
+
+	return get_monotonic_usec();
+}
+
 static int init_mmap(struct cap_handle *handle)
 {
 	struct v4l2_requestbuffers req;
 	CLEAR(req);
 
-	req.count = 4;
+	req.count = handle->params.nbuffers;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
@@ -92,6 +119,10 @@ static int init_mmap(struct cap_handle *handle)
 		return -1;
 	}
 
+	if (req.count != (unsigned int) handle->params.nbuffers)
+		printf("!!! Requested %d buffers, the driver gives %d\n",
+				handle->params.nbuffers, req.count);
+
 	handle->buffers = calloc(req.count, sizeof(struct buffer_t));
 	if (!handle->buffers)
 	{
@@ -119,14 +150,38 @@ static int init_mmap(struct cap_handle *handle)
 			printf("--- Index: %d, memory map failed\n", handle->nbuffers);
 			goto err;
 		}
+
+		handle->buffers[handle->nbuffers].dmabuf_fd = -1;
+		if (handle->params.export_dmabuf)
+		{
+			struct v4l2_exportbuffer expbuf;
+			CLEAR(expbuf);
+			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			expbuf.index = handle->nbuffers;
+			expbuf.flags = O_RDWR | O_CLOEXEC;
+			if (xioctl(handle->fd, VIDIOC_EXPBUF, &expbuf) == -1)
+			{
+				printf("--- Index: %d, VIDIOC_EXPBUF failed: %s\n",
+						handle->nbuffers, strerror(errno));
+				munmap(handle->buffers[handle->nbuffers].start,
+						handle->buffers[handle->nbuffers].length);
+				goto err;
+			}
+			handle->buffers[handle->nbuffers].dmabuf_fd = expbuf.fd;
+		}
 	}
 
+	if (handle->params.export_dmabuf)
+		printf("+++ %d buffers exported as dmabuf\n", handle->nbuffers);
+
 	printf("+++ Device initialized\n");
 	return 0;
 
 	err: while (handle->nbuffers > 0)
 	{
 		handle->nbuffers--;
+		if (handle->buffers[handle->nbuffers].dmabuf_fd >= 0)
+			close(handle->buffers[handle->nbuffers].dmabuf_fd);
 		munmap(handle->buffers[handle->nbuffers].start,
 				handle->buffers[handle->nbuffers].length);
 	}
@@ -234,12 +289,15 @@ static int init_device(struct cap_handle *handle)
 	}
 
 	unsigned int min;
-	min = fmt.fmt.pix.width * 2;
+	min = fmt.fmt.pix.width;
+	if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUV420)
+		min *= 2;
 	if (fmt.fmt.pix.bytesperline < min)
 		fmt.fmt.pix.bytesperline = min;
 	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
 	if (fmt.fmt.pix.sizeimage < min)
 		fmt.fmt.pix.sizeimage = min;
+	handle->bytesperline = fmt.fmt.pix.bytesperline;
 
 	// set capture params
 	CLEAR(sparam);
@@ -277,12 +335,32 @@ struct cap_handle *capture_open(struct cap_param param)
 	CLEAR(*handle);
 	handle->quit = 0;
 	handle->image_counter = 0;
-	handle->v4lbuf_put = 1;
+	handle->nqueued = 0;
+	handle->frame_put = 1;
 	handle->params.dev_name = param.dev_name;
 	handle->params.width = param.width;
 	handle->params.height = param.height;
 	handle->params.pixfmt = param.pixfmt;
 	handle->params.rate = param.rate;
+	handle->params.nbuffers = param.nbuffers;
+	handle->params.export_dmabuf = param.export_dmabuf;
+	handle->params.source = param.source;
+	if (handle->params.nbuffers <= 0)
+		handle->params.nbuffers = DEFAULT_NBUFFERS;
+
+	if (handle->params.source != CAP_V4L)
+	{
+		handle->fd = -1;
+		handle->vcap = vcap_open(handle->params);
+		if (!handle->vcap)
+		{
+			printf("--- Open virtual capture source failed\n");
+			goto err;
+		}
+
+		printf("+++ Capture Opened\n");
+		return handle;
+	}
 
 	struct stat st;
 	if (-1 == stat(handle->params.dev_name, &st))
@@ -325,7 +403,11 @@ static void uninit_device(struct cap_handle *handle)
 {
 	unsigned int i;
 	for (i = 0; i < handle->nbuffers; ++i)
+	{
+		if (handle->buffers[i].dmabuf_fd >= 0)
+			close(handle->buffers[i].dmabuf_fd);
 		munmap(handle->buffers[i].start, handle->buffers[i].length);
+	}
 
 	free(handle->buffers);
 	handle->buffers = NULL;
@@ -334,6 +416,14 @@ static void uninit_device(struct cap_handle *handle)
 
 void capture_close(struct cap_handle *handle)
 {
+	if (handle->vcap)
+	{
+		vcap_close(handle->vcap);
+		free(handle);
+		printf("+++ Capture Closed\n");
+		return;
+	}
+
 	uninit_device(handle);
 
 	if (handle->fd == -1)
@@ -352,6 +442,12 @@ int capture_start(struct cap_handle *handle)
 	unsigned int i;
 	enum v4l2_buf_type btype;
 
+	if (handle->vcap)
+	{
+		handle->frame_put = 1;
+		return vcap_start(handle->vcap);
+	}
+
 	for (i = 0; i < handle->nbuffers; ++i)
 	{
 		struct v4l2_buffer buf;
@@ -364,7 +460,10 @@ int capture_start(struct cap_handle *handle)
 			printf("--- Index: %d, VIDIOC_QBUF failed\n", i);
 			return -1;
 		}
+		handle->buffers[i].queued = 1;
 	}
+	handle->nqueued = handle->nbuffers;
+	handle->frame_put = 1;
 
 	btype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	if (xioctl(handle->fd, VIDIOC_STREAMON, &btype) == -1)
@@ -380,17 +479,45 @@ int capture_start(struct cap_handle *handle)
 void capture_stop(struct cap_handle *handle)
 {
 	enum v4l2_buf_type btype;
+
+	if (handle->vcap)
+	{
+		vcap_stop(handle->vcap);
+		return;
+	}
+
 	btype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	xioctl(handle->fd, VIDIOC_STREAMOFF, &btype);
+
+	// STREAMOFF dequeues all the buffers
+	unsigned int i;
+	for (i = 0; i < handle->nbuffers; ++i)
+		handle->buffers[i].queued = 0;
+	handle->nqueued = 0;
 	printf("+++ Capture Stopped\n");
 }
 
-int capture_get_data(struct cap_handle *handle, void **buf, int *len)
+int capture_acquire(struct cap_handle *handle, struct cap_frame *frame)
 {
 	fd_set fds;
 	struct timeval tv;
+	struct v4l2_buffer buf;
 	int ret = 0;
 
+	if (handle->vcap)
+	{
+		ret = vcap_acquire(handle->vcap, frame);
+		if (ret == 0)
+			handle->image_counter++;
+		return ret;
+	}
+
+	if (handle->nqueued == 0)
+	{
+		printf("--- All capture buffers are held, release some firstly!\n");
+		return -1;
+	}
+
 	FD_ZERO(&fds);
 	FD_SET(handle->fd, &fds);
 	tv.tv_sec = 2;    // must be reset
@@ -409,24 +536,12 @@ int capture_get_data(struct cap_handle *handle, void **buf, int *len)
 		return -1;
 	}
 
-	// put the v4l buffer to the queue if it's not
-	if (!handle->v4lbuf_put)
-	{
-		if (xioctl(handle->fd, VIDIOC_QBUF, &handle->v4lbuf) == -1)
-		{
-			printf("--- VIDIOC_QBUF failed\n");
-			return -1;
-		}
-
-		handle->v4lbuf_put = 1;
-	}
-
 	// fill the buffer from queue
-	CLEAR(handle->v4lbuf);
-	handle->v4lbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	handle->v4lbuf.memory = V4L2_MEMORY_MMAP;
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
 
-	if (xioctl(handle->fd, VIDIOC_DQBUF, &handle->v4lbuf) == -1)
+	if (xioctl(handle->fd, VIDIOC_DQBUF, &buf) == -1)
 	{
 		switch (errno)
 		{
@@ -439,15 +554,80 @@ int capture_get_data(struct cap_handle *handle, void **buf, int *len)
 		}
 	}
 
-	assert((handle->v4lbuf.index < handle->nbuffers));
-	*buf = handle->buffers[handle->v4lbuf.index].start;
-	*len = handle->image_size;
+	assert((buf.index < handle->nbuffers));
+	handle->buffers[buf.index].queued = 0;    // the user owns it now
+	handle->nqueued--;
+
+	frame->start = handle->buffers[buf.index].start;
+	frame->length = handle->image_size;
+	frame->bytesperline = handle->bytesperline;
+	frame->index = buf.index;
+	frame->dmabuf_fd = handle->buffers[buf.index].dmabuf_fd;
+	frame->timestamp = get_buffer_timestamp(&buf);
+	frame->sequence = buf.sequence;
 
-	handle->v4lbuf_put = 0;    // the v4l buffer needs to put to the queue
 	handle->image_counter++;
 	return 0;
 }
 
+int capture_release(struct cap_handle *handle, struct cap_frame *frame)
+{
+	struct v4l2_buffer buf;
+
+	if (handle->vcap)
+		return vcap_release(handle->vcap, frame);
+
+	if (frame->index < 0 || (unsigned int) frame->index >= handle->nbuffers)
+	{
+		printf("--- Invalid capture buffer index: %d\n", frame->index);
+		return -1;
+	}
+
+	if (handle->buffers[frame->index].queued)
+	{
+		printf("!!! Capture buffer %d is released twice\n", frame->index);
+		return -1;
+	}
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = frame->index;
+	if (xioctl(handle->fd, VIDIOC_QBUF, &buf) == -1)
+	{
+		printf("--- Index: %d, VIDIOC_QBUF failed\n", frame->index);
+		return -1;
+	}
+
+	handle->buffers[frame->index].queued = 1;
+	handle->nqueued++;
+	return 0;
+}
+
+int capture_get_data(struct cap_handle *handle, void **buf, int *len)
+{
+	int ret;
+
+	// put the last frame back to the queue if it's not
+	if (!handle->frame_put)
+	{
+		if (capture_release(handle, &handle->frame) < 0)
+			return -1;
+
+		handle->frame_put = 1;
+	}
+
+	ret = capture_acquire(handle, &handle->frame);
+	if (ret != 0)
+		return ret;
+
+	*buf = handle->frame.start;
+	*len = handle->frame.length;
+
+	handle->frame_put = 0;    // the frame needs to put to the queue
+	return 0;
+}
+
 int capture_query_brightness(struct cap_handle *handle, int *min, int *max,
 		int *step)
 {
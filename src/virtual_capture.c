@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/videodev2.h>
+#include "virtual_capture.h"
+
+#define NBARS 8
+#define DOT_SIZE 8		// size of a counter font dot (px), must be even
+#define DIGIT_MAX 10
+
+// 75% color bars: white, yellow, cyan, green, magenta, red, blue, black
+static const unsigned char bar_colors[NBARS][3] =
+{
+{ 180, 128, 128 },
+{ 162, 44, 142 },
+{ 131, 156, 44 },
+{ 112, 72, 58 },
+{ 84, 184, 198 },
+{ 65, 100, 212 },
+{ 35, 212, 114 },
+{ 16, 128, 128 } };
+
+// 3x5 digit font, one bit per dot, the MSB is the top left one
+static const unsigned short digit_font[10] =
+{ 0x7b6f, 0x2c97, 0x73e7, 0x73cf, 0x5bc9, 0x79cf, 0x79ef, 0x7249, 0x7bef,
+		0x7bcf };
+
+struct vbuffer_t
+{
+	void *start;
+	int held;		// 0/1, owned by the user
+};
+
+struct vcap_handle
+{
+	struct cap_param params;
+	int image_size;
+	struct vbuffer_t *buffers;
+	unsigned int nbuffers;
+	unsigned int nheld;
+	int started;
+	U32 sequence;
+	U64 next_time;		// when the next frame is due (microsecond)
+
+	// raw file source
+	void *file_start;
+	size_t file_size;
+	unsigned int nframes;
+
+	// test pattern source
+	void *pattern_mem;
+	unsigned char *bar_line;	// two lines of bars, rows are copied from a moving offset
+};
+
+static U64 get_monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (U64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void wait_next_frame(struct vcap_handle *handle)
+{
+	if (handle->params.rate <= 0)    // unlimited, as fast as the consumer
+		return;
+
+	U64 now = get_monotonic_usec();
+	if (handle->next_time == 0 || now > handle->next_time + 1000000)
+		handle->next_time = now;    // (re)start, don't catch up a long stall
+	else if (now < handle->next_time)
+	{
+		struct timespec ts;
+		ts.tv_sec = handle->next_time / 1000000;
+		ts.tv_nsec = (handle->next_time % 1000000) * 1000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+				== EINTR)
+			;
+	}
+
+	handle->next_time += 1000000 / handle->params.rate;
+}
+
+static int init_file(struct vcap_handle *handle)
+{
+	struct stat st;
+	int fd = open(handle->params.dev_name, O_RDONLY);
+	if (fd == -1)
+	{
+		printf("--- Cannot open raw file %s: %d, %s\n",
+				handle->params.dev_name, errno, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < handle->image_size)
+	{
+		printf("--- %s holds no whole frame of %d bytes\n",
+				handle->params.dev_name, handle->image_size);
+		close(fd);
+		return -1;
+	}
+
+	// private writable mapping, so the consumers may draw on the frames
+	handle->file_size = st.st_size;
+	handle->file_start = mmap(NULL, handle->file_size, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (handle->file_start == MAP_FAILED)
+	{
+		printf("--- memory map %s failed\n", handle->params.dev_name);
+		handle->file_start = NULL;
+		return -1;
+	}
+	madvise(handle->file_start, handle->file_size, MADV_SEQUENTIAL);
+
+	handle->nframes = handle->file_size / handle->image_size;
+	printf("+++ Replay %u frames from %s\n", handle->nframes,
+			handle->params.dev_name);
+	return 0;
+}
+
+static int init_pattern(struct vcap_handle *handle)
+{
+	int width = handle->params.width;
+	int i, x;
+
+	handle->pattern_mem = malloc(handle->image_size * handle->nbuffers);
+	handle->bar_line = malloc(width * 2 * 2);    // 2 lines of 16 bits pixels at most
+	if (!handle->pattern_mem || !handle->bar_line)
+	{
+		printf("--- malloc test pattern buffers failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < (int) handle->nbuffers; i++)
+		handle->buffers[i].start = handle->pattern_mem + i * handle->image_size;
+
+	// YUYV: a run of macro pixels, YUV420: Y run followed by U and V runs of half size
+	unsigned char *yline = handle->bar_line;
+	unsigned char *uline = yline + width * 2;
+	unsigned char *vline = uline + width;
+	for (x = 0; x < width * 2; x += 2)
+	{
+		const unsigned char *c = bar_colors[(x % width) * NBARS / width];
+		if (handle->params.pixfmt == V4L2_PIX_FMT_YUYV)
+		{
+			yline[x * 2 + 0] = c[0];
+			yline[x * 2 + 1] = c[1];
+			yline[x * 2 + 2] = c[0];
+			yline[x * 2 + 3] = c[2];
+		}
+		else
+		{
+			yline[x] = yline[x + 1] = c[0];
+			uline[x / 2] = c[1];
+			vline[x / 2] = c[2];
+		}
+	}
+
+	printf("+++ Test pattern initialized\n");
+	return 0;
+}
+
+static void fill_rect(struct vcap_handle *handle, unsigned char *image, int x0,
+		int y0, int w, int h, unsigned char luma)
+{
+	int width = handle->params.width;
+	int x, y;
+
+	for (y = y0; y < y0 + h; y++)
+	{
+		if (handle->params.pixfmt == V4L2_PIX_FMT_YUYV)
+		{
+			unsigned char *p = image + (y * width + x0) * 2;
+			for (x = 0; x < w; x += 2, p += 4)
+			{
+				p[0] = p[2] = luma;
+				p[1] = p[3] = 128;
+			}
+		}
+		else
+		{
+			memset(image + y * width + x0, luma, w);
+			if ((y & 1) == 0)
+			{
+				unsigned char *u = image + width * handle->params.height
+						+ (y / 2) * (width / 2) + x0 / 2;
+				unsigned char *v = u + width * handle->params.height / 4;
+				memset(u, 128, w / 2);
+				memset(v, 128, w / 2);
+			}
+		}
+	}
+}
+
+static void draw_counter(struct vcap_handle *handle, unsigned char *image,
+		U32 counter)
+{
+	char digits[DIGIT_MAX + 1];
+	int i, n, dot;
+
+	n = snprintf(digits, sizeof(digits), "%u", counter);
+	if ((n * 4 + 1) * DOT_SIZE > handle->params.width
+			|| 7 * DOT_SIZE > handle->params.height)
+		return;    // too small a picture
+
+	// a black box with the white digits
+	fill_rect(handle, image, 0, 0, (n * 4 + 1) * DOT_SIZE, 7 * DOT_SIZE, 16);
+	for (i = 0; i < n; i++)
+	{
+		unsigned short glyph = digit_font[digits[i] - '0'];
+		for (dot = 0; dot < 15; dot++)
+		{
+			if (glyph & (0x4000 >> dot))
+				fill_rect(handle, image, (i * 4 + 1 + dot % 3) * DOT_SIZE,
+						(1 + dot / 3) * DOT_SIZE, DOT_SIZE, DOT_SIZE, 235);
+		}
+	}
+}
+
+static void render_pattern(struct vcap_handle *handle, unsigned char *image)
+{
+	int width = handle->params.width;
+	int height = handle->params.height;
+	int offset = (handle->sequence * 4) % width;    // bars move 4px a frame
+	int y;
+
+	if (handle->params.pixfmt == V4L2_PIX_FMT_YUYV)
+	{
+		for (y = 0; y < height; y++)
+			memcpy(image + y * width * 2, handle->bar_line + offset * 2,
+					width * 2);
+	}
+	else
+	{
+		unsigned char *uplane = image + width * height;
+		unsigned char *vplane = uplane + width * height / 4;
+		for (y = 0; y < height; y++)
+			memcpy(image + y * width, handle->bar_line + offset, width);
+		for (y = 0; y < height / 2; y++)
+		{
+			memcpy(uplane + y * width / 2,
+					handle->bar_line + width * 2 + offset / 2, width / 2);
+			memcpy(vplane + y * width / 2,
+					handle->bar_line + width * 3 + offset / 2, width / 2);
+		}
+	}
+
+	draw_counter(handle, image, handle->sequence);
+}
+
+struct vcap_handle *vcap_open(struct cap_param param)
+{
+	int ret;
+	struct vcap_handle *handle = malloc(sizeof(struct vcap_handle));
+	if (!handle)
+	{
+		printf("--- malloc virtual capture handle failed\n");
+		return NULL;
+	}
+
+	CLEAR(*handle);
+	handle->params = param;
+	if (handle->params.export_dmabuf)
+	{
+		printf("!!! dmabuf export is not supported by virtual sources\n");
+		handle->params.export_dmabuf = 0;
+	}
+
+	if ((handle->params.width & 1) || (handle->params.height & 1))
+	{
+		printf("--- Width and height must be even\n");
+		goto err0;
+	}
+
+	switch (handle->params.pixfmt)
+	{
+		case V4L2_PIX_FMT_YUYV:
+			handle->image_size = handle->params.width * handle->params.height
+					* 2;
+			break;
+		case V4L2_PIX_FMT_YUV420:
+			handle->image_size = handle->params.width * handle->params.height
+					* 3 / 2;
+			break;
+		default:
+			printf("--- Only YUYV and YUV420 are supported by virtual sources\n");
+			goto err0;
+	}
+
+	handle->nbuffers = handle->params.nbuffers;
+	handle->buffers = calloc(handle->nbuffers, sizeof(struct vbuffer_t));
+	if (!handle->buffers)
+	{
+		printf("--- Calloc memory failed\n");
+		goto err0;
+	}
+
+	if (handle->params.source == CAP_FILE)
+		ret = init_file(handle);
+	else
+		ret = init_pattern(handle);
+	if (ret < 0)
+		goto err1;
+
+	printf("+++ Virtual Capture Opened\n");
+	return handle;
+
+	err1: free(handle->pattern_mem);
+	free(handle->bar_line);
+	free(handle->buffers);
+	err0: free(handle);
+	return NULL;
+}
+
+void vcap_close(struct vcap_handle *handle)
+{
+	if (handle->file_start)
+		munmap(handle->file_start, handle->file_size);
+	free(handle->pattern_mem);
+	free(handle->bar_line);
+	free(handle->buffers);
+	free(handle);
+	printf("+++ Virtual Capture Closed\n");
+}
+
+int vcap_start(struct vcap_handle *handle)
+{
+	unsigned int i;
+	for (i = 0; i < handle->nbuffers; i++)
+		handle->buffers[i].held = 0;
+	handle->nheld = 0;
+	handle->next_time = 0;
+	handle->started = 1;
+
+	printf("+++ Virtual Capture Started\n");
+	return 0;
+}
+
+void vcap_stop(struct vcap_handle *handle)
+{
+	handle->started = 0;
+	printf("+++ Virtual Capture Stopped\n");
+}
+
+int vcap_acquire(struct vcap_handle *handle, struct cap_frame *frame)
+{
+	unsigned int i;
+
+	if (!handle->started)
+	{
+		printf("--- Start the capture firstly!\n");
+		return -1;
+	}
+
+	if (handle->nheld == handle->nbuffers)
+	{
+		printf("--- All capture buffers are held, release some firstly!\n");
+		return -1;
+	}
+
+	for (i = 0; handle->buffers[i].held; i++)
+		;
+
+	wait_next_frame(handle);
+
+	if (handle->params.source == CAP_FILE)    // loop over the file
+		handle->buffers[i].start = handle->file_start
+				+ (size_t) (handle->sequence % handle->nframes)
+						* handle->image_size;
+	else
+		render_pattern(handle, handle->buffers[i].start);
+
+	handle->buffers[i].held = 1;
+	handle->nheld++;
+
+	frame->start = handle->buffers[i].start;
+	frame->length = handle->image_size;
+	frame->bytesperline =
+			handle->params.pixfmt == V4L2_PIX_FMT_YUYV ?
+					handle->params.width * 2 : handle->params.width;
+	frame->index = i;
+	frame->dmabuf_fd = -1;
+	frame->timestamp = get_monotonic_usec();
+	frame->sequence = handle->sequence++;
+	return 0;
+}
+
+int vcap_release(struct vcap_handle *handle, struct cap_frame *frame)
+{
+	if (frame->index < 0 || (unsigned int) frame->index >= handle->nbuffers)
+	{
+		printf("--- Invalid capture buffer index: %d\n", frame->index);
+		return -1;
+	}
+
+	if (!handle->buffers[frame->index].held)
+	{
+		printf("!!! Capture buffer %d is released twice\n", frame->index);
+		return -1;
+	}
+
+	handle->buffers[frame->index].held = 0;
+	handle->nheld--;
+	return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2014 Andy Huang <andyspider@126.com>
+ *
+ * This file is part of Camkit.
+ *
+ * Camkit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Camkit is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Camkit; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef VIRTUAL_CAPTURE_H
+#define VIRTUAL_CAPTURE_H
+#include "camkit/capture.h"
+
+/**< virtual capture source handle, see capture_open() */
+struct vcap_handle;
+
+struct vcap_handle *vcap_open(struct cap_param param);
+void vcap_close(struct vcap_handle *handle);
+int vcap_start(struct vcap_handle *handle);
+void vcap_stop(struct vcap_handle *handle);
+int vcap_acquire(struct vcap_handle *handle, struct cap_frame *frame);
+int vcap_release(struct vcap_handle *handle, struct cap_frame *frame);
+
+#endif
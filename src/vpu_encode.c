@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "camkit/encode.h"
 
 #define STREAM_BUF_SIZE 0x200000
@@ -63,10 +64,21 @@ struct enc_handle
 	U32 y_addr;
 	int mvc_extension;
 	EncParam enc_param;
+	struct enc_stats stats;		// of the last frame
+	int has_stats;		// 0/1
+	struct enc_nal nal;		// of the last frame
+	int nnals;		// 0 if not known
 
 	struct enc_param params;
 };
 
+static U64 get_monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (U64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void init_framebuf(struct enc_handle *handle)
 {
 	int i;
@@ -376,6 +388,13 @@ struct enc_handle *encode_open(struct enc_param param)
 	handle->params.bitrate = param.bitrate;
 	handle->params.gop = param.gop;
 	handle->params.chroma_interleave = param.chroma_interleave;
+	handle->params.max_slice_size = param.max_slice_size;
+	handle->params.intra_refresh = param.intra_refresh;
+	handle->params.thread_type = param.thread_type;
+	handle->params.threads = param.threads;    // hardware encoder, no threads to set
+	handle->params.temporal_layers = param.temporal_layers;
+	if (handle->params.temporal_layers > 1)
+		printf("!!! Temporal layers are not supported, every frame is a reference\n");
 
 	RetCode ret;
 
@@ -443,10 +462,22 @@ struct enc_handle *encode_open(struct enc_param param)
 	encop.slicemode.sliceMode = 0; /* 0: 1 slice per picture; 1: Multiple slices per picture */
 	encop.slicemode.sliceSizeMode = 0; /* 0: silceSize defined by bits; 1: sliceSize defined by MB number*/
 	encop.slicemode.sliceSize = 4000; /* Size of a slice in bits or MB numbers */
+	if (handle->params.max_slice_size > 0)    // slices fit a packet, no FU-A
+	{
+		encop.slicemode.sliceMode = 1;
+		encop.slicemode.sliceSize = handle->params.max_slice_size * 8;
+	}
 
 	encop.initialDelay = 0;
 	encop.vbvBufferSize = 0; /* 0 = ignore 8 */
 	encop.intraRefresh = 0;
+	if (handle->params.intra_refresh && handle->params.gop > 0)
+	{
+		// intra MBs of every frame, the whole picture in gop frames, I-frame only at the start
+		int mbs = ((encop.picWidth + 15) / 16) * ((encop.picHeight + 15) / 16);
+		encop.intraRefresh = (mbs + handle->params.gop - 1) / handle->params.gop;
+		encop.gopSize = 0;
+	}
 	encop.sliceReport = 0;
 	encop.mbReport = 0;
 	encop.mbQpReport = 0;
@@ -652,19 +683,36 @@ static int encode_fill_data(struct enc_handle *handle, void *buf, int len)
 				__FILE__, __FUNCTION__);
 		abort();
 	}
-	memcpy((void *) handle->y_addr, buf, handle->yuv420_imgsize);
+	if (buf != (void *) handle->y_addr)	// already there if filled via encode_get_inbuf()
+		memcpy((void *) handle->y_addr, buf, handle->yuv420_imgsize);
 
 	return handle->yuv420_imgsize;
 }
 
+int encode_get_inbuf(struct enc_handle *handle, void **pbuf, int *plen)
+{
+	*pbuf = (void *) handle->y_addr;
+	*plen = handle->yuv420_imgsize;
+
+	return 0;
+}
+
 int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 		int *polen, enum pic_t *type)
+{
+	U64 ots;
+	return encode_do_ts(handle, ibuf, ilen, 0, pobuf, polen, type, &ots);
+}
+
+int encode_do_ts(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		void **pobuf, int *polen, enum pic_t *type, U64 *pots)
 {
 	EncOutputInfo outinfo =
 	{ 0 };
 	RetCode ret = 0;
 	int loop_id;
 	enum pic_t pictp = NONE;
+	U64 start = get_monotonic_usec();
 
 	ret = encode_fill_data(handle, ibuf, ilen);
 	if (ret < 0)
@@ -726,6 +774,33 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 	*pobuf = (void *) vbuf;
 	*polen = outinfo.bitstreamSize;
 	*type = pictp;
+	*pots = its;    // the vpu encodes one frame at a time, no delay
+
+	handle->stats.encode_usec = get_monotonic_usec() - start;
+	handle->stats.bytes = outinfo.bitstreamSize;
+	// the vpu doesn't report the qp, it's known only without rate control
+	handle->stats.qp =
+			handle->params.bitrate == 0 ? handle->enc_param.quantParam : -1;
+	handle->stats.type = pictp;
+	handle->stats.keyframe = pictp == I;
+	handle->stats.timestamp = its;
+	handle->has_stats = 1;
+
+	// one slice per picture and the headers come from encode_get_headers(): a frame is one NALU
+	const unsigned char *nbuf = (const unsigned char *) vbuf;
+	int sc = 0;
+	if (*polen > 4 && nbuf[0] == 0 && nbuf[1] == 0 && nbuf[2] == 0 && nbuf[3] == 1)
+		sc = 4;
+	else if (*polen > 3 && nbuf[0] == 0 && nbuf[1] == 0 && nbuf[2] == 1)
+		sc = 3;
+	handle->nnals = 0;
+	if (handle->params.max_slice_size <= 0 && sc)
+	{
+		handle->nal.offset = sc;
+		handle->nal.size = *polen - sc;
+		handle->nal.type = nbuf[sc] & 0x1f;
+		handle->nnals = 1;
+	}
 
 	handle->frame_counter++;
 	if (++handle->gop_offset_counter >= handle->params.gop)
@@ -734,6 +809,56 @@ int encode_do(struct enc_handle *handle, void *ibuf, int ilen, void **pobuf,
 	return 0;
 }
 
+int encode_do_ref(struct enc_handle *handle, void *ibuf, int ilen, U64 its,
+		enc_release_fn release, void *opaque, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	// the frame is copied into the encoder's own buffer, it's free right away
+	int ret = encode_do_ts(handle, ibuf, ilen, its, pobuf, polen, type, pots);
+	release(opaque, ibuf);
+
+	return ret;
+}
+
+int encode_get_packet(struct enc_handle *handle, void **pobuf, int *polen,
+		enum pic_t *type, U64 *pots)
+{
+	// encode_do() returns every frame, nothing is left behind
+	UNUSED(handle);
+	*pobuf = NULL;
+	*polen = 0;
+	*type = NONE;
+	*pots = 0;
+
+	return 0;
+}
+
+int encode_flush(struct enc_handle *handle)
+{
+	UNUSED(handle);
+	return 0;
+}
+
+int encode_get_stats(struct enc_handle *handle, struct enc_stats *stats)
+{
+	if (!handle->has_stats)
+		return -1;
+
+	*stats = handle->stats;
+	return 0;
+}
+
+int encode_get_nals(struct enc_handle *handle, const struct enc_nal **pnals,
+		int *pnnals)
+{
+	if (handle->nnals <= 0)    // slices are not reported (sliceReport is off)
+		return -1;
+
+	*pnals = &handle->nal;
+	*pnnals = handle->nnals;
+	return 0;
+}
+
 int encode_set_qp(struct enc_handle *handle, int val)
 {
 	int valid = 23;